@@ -5,6 +5,9 @@ struct Color {
   unsigned char g = 0;
   unsigned char b = 0;
 
+  bool operator==(const Color& other) const { return r == other.r && g == other.g && b == other.b; }
+  bool operator!=(const Color& other) const { return !(*this == other); }
+
   // https://github.com/mbadolato/iTerm2-Color-Schemes/blob/master/windowsterminal/Ubuntu.json
   static Color from8(unsigned char val) {
     switch (val) {
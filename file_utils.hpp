@@ -0,0 +1,94 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+
+// raii wrapper of file descriptor
+class FileDescriptor {
+  int fd = -1;
+
+ public:
+  FileDescriptor(const char* path, int flags) noexcept : fd(::open(path, flags)) {}
+  // takes ownership of an already open fd
+  explicit FileDescriptor(int fd) noexcept : fd(fd) {}
+
+  FileDescriptor(const FileDescriptor&) = delete;
+  FileDescriptor& operator=(const FileDescriptor&) = delete;
+  FileDescriptor& operator=(FileDescriptor&& other) = delete;
+
+  FileDescriptor(FileDescriptor&& other) noexcept : fd(other.fd) { //
+    other.fd = -1;
+  }
+
+  explicit operator bool() const noexcept { return this->fd != -1; }
+  operator int() const noexcept { return this->fd; }
+
+  // only explicitly close when necessary.
+  // otherwise, allow dtor to close.
+  bool close() noexcept {
+    if (*this) {
+      bool close_success = ::close(*this) != -1;
+      this->fd = -1;
+      return close_success;
+    }
+    return true;
+  }
+
+  ~FileDescriptor() {
+    if (!close()) {
+      // log failure. no other action required or available given dtor context
+      perror("err fd close");
+    }
+  }
+};
+
+// writes everything, retrying short writes. false on failure (error printed)
+bool write_all(int fd, const void* data, size_t length) {
+  size_t written = 0;
+  while (written < length) {
+    ssize_t ret = ::write(fd, (const char*)data + written, length - written);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("err write");
+      return false;
+    }
+    written += ret;
+  }
+  return true;
+}
+
+// $XDG_CACHE_HOME/name, or ~/.cache/name if that isn't set. created if it doesn't exist.
+// empty for failure (error printed)
+std::string get_cache_dir(const char* name) {
+  std::string dir;
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  if (xdg != NULL && *xdg != '\0') {
+    dir = xdg;
+  } else {
+    const char* home = getenv("HOME");
+    if (home == NULL || *home == '\0') {
+      fputs("err cache dir: neither XDG_CACHE_HOME nor HOME is set\n", stderr);
+      return {};
+    }
+    dir = std::string(home) + "/.cache";
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+      fprintf(stderr, "err mkdir %s: %s\n", dir.c_str(), strerror(errno));
+      return {};
+    }
+  }
+  dir += '/';
+  dir += name;
+  if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+    fprintf(stderr, "err mkdir %s: %s\n", dir.c_str(), strerror(errno));
+    return {};
+  }
+  return dir;
+}
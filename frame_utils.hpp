@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <optional>
+
+// decides when to present. output is parsed into the screen as fast as it arrives,
+// but the view is presented at most once per display refresh. while output keeps
+// arriving, presenting is put off so more of it goes into the same frame, but a
+// change is never left unpresented for longer than max_latency.
+//
+// while flooding (output scrolls past faster than it could be read anyway) frames are
+// presented at most once per flood_interval instead, which leaves more time for parsing.
+//
+// presentation can be held while an application is in the middle of an update, so a
+// half drawn frame is never shown (synchronized output, DEC mode 2026)
+class FrameScheduler {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+ private:
+  Clock::duration frame_interval;
+  Clock::duration max_latency;
+  Clock::duration flood_interval;
+  bool flooding = false;
+  Clock::duration hold_timeout;
+  std::optional<Clock::time_point> held_since;
+  Clock::time_point last_present;
+  std::optional<Clock::time_point> changed_since; // the oldest change that hasn't been presented
+
+ public:
+  FrameScheduler(Clock::duration frame_interval, Clock::duration max_latency, Clock::duration flood_interval, Clock::duration hold_timeout)
+      : frame_interval(frame_interval),
+        max_latency(std::max(max_latency, frame_interval)),
+        flood_interval(flood_interval),
+        hold_timeout(hold_timeout) {}
+
+  void set_flooding(bool value) { flooding = value; }
+
+  // nothing is presented until release, or until hold_timeout has passed (in case
+  // release never comes, e.g. the application was killed mid update)
+  void hold(Clock::time_point now) {
+    if (!held_since || now - *held_since >= hold_timeout) {
+      held_since = now;
+    }
+  }
+  void release() { held_since.reset(); }
+  bool is_held() const { return held_since.has_value(); }
+
+  Clock::duration interval() const { return flooding ? std::max(flood_interval, frame_interval) : frame_interval; }
+  Clock::duration latency() const { return flooding ? std::max(flood_interval, max_latency) : max_latency; }
+
+  // something visible changed
+  void changed(Clock::time_point now) {
+    if (!changed_since) {
+      changed_since = now;
+    }
+  }
+
+  // more_output: more is ready to be parsed right now, so waiting would put it in this frame
+  bool should_present(Clock::time_point now, bool more_output) const {
+    if (!changed_since) {
+      return false;
+    }
+    if (held_since && now - *held_since < hold_timeout) {
+      return false;
+    }
+    if (now - *changed_since >= latency()) {
+      return true;
+    }
+    if (now - last_present < interval()) {
+      return false;
+    }
+    return !more_output;
+  }
+
+  void presented(Clock::time_point now) {
+    last_present = now;
+    changed_since.reset();
+    if (held_since && now - *held_since >= hold_timeout) {
+      held_since.reset(); // timed out. the next hold starts a new one
+    }
+  }
+
+  // how long until should_present(now, false) becomes true. max() if nothing changed
+  Clock::duration time_until_due(Clock::time_point now) const {
+    if (!changed_since) {
+      return Clock::duration::max();
+    }
+    Clock::time_point due = std::min(*changed_since + latency(), last_present + interval());
+    if (held_since) {
+      due = std::max(due, *held_since + hold_timeout);
+    }
+    return due > now ? due - now : Clock::duration::zero();
+  }
+};
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "file_utils.hpp"
+
+// rasterized glyphs, saved between runs so that startup doesn't need to render them again.
+// there's one file per font. it's only valid for the font file it was made from (same path,
+// mtime and size) at the same resolution. a stale file is deleted when it's opened, and a new
+// one is written on exit.
+//
+// the file is mapped, and the pixels are copied straight from it into the atlases. layout:
+// Header, the font's path (not null terminated), padding to 8 bytes, Entry[entry_count], pixels
+class GlyphCache {
+ public:
+  // what the file is valid for
+  struct Key {
+    std::string font_path;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t font_size;
+    uint32_t resolution;
+  };
+
+  struct Entry {
+    uint32_t code_point;
+    uint16_t width;
+    uint16_t height;
+    uint64_t offset; // from the start of the file, of width * height ARGB8888 pixels
+  };
+
+ private:
+  static constexpr char MAGIC[8] = {'G', 'L', 'Y', 'P', 'H', 'S', '0', '1'};
+
+  struct Header {
+    char magic[8];
+    uint32_t resolution;
+    uint32_t path_length;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t font_size;
+    uint64_t entry_count;
+  };
+
+  static size_t entries_offset(size_t path_length) { return (sizeof(Header) + path_length + 7) / 8 * 8; }
+
+  const char* mapping;
+  size_t mapped_size;
+
+  GlyphCache(const char* mapping, size_t mapped_size) : mapping(mapping), mapped_size(mapped_size) {}
+
+  // the mapping is a cache file for the key, and isn't truncated.
+  // every glyph is at most max_glyph_size wide and high
+  bool valid(const Key& key, uint16_t max_glyph_size) const {
+    if (mapped_size < sizeof(Header)) {
+      return false;
+    }
+    const Header& h = header();
+    if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.resolution != key.resolution || h.mtime_sec != key.mtime_sec ||
+        h.mtime_nsec != key.mtime_nsec || h.font_size != key.font_size || h.path_length != key.font_path.size()) {
+      return false;
+    }
+    size_t entries_end = entries_offset(h.path_length) + h.entry_count * sizeof(Entry);
+    if (entries_end > mapped_size || h.entry_count > mapped_size / sizeof(Entry) ||
+        memcmp(mapping + sizeof(Header), key.font_path.data(), h.path_length) != 0) {
+      return false;
+    }
+    for (size_t i = 0; i < size(); ++i) {
+      const Entry& e = (*this)[i];
+      if (e.width == 0 || e.height == 0 || e.width > max_glyph_size || e.height > max_glyph_size) {
+        return false;
+      }
+      uint64_t length = (uint64_t)e.width * e.height * sizeof(uint32_t);
+      if (e.offset % sizeof(uint32_t) != 0 || e.offset < entries_end || e.offset > mapped_size || length > mapped_size - e.offset) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const Header& header() const { return *(const Header*)mapping; }
+
+ public:
+  // empty if the font file can't be found (error printed)
+  static std::optional<Key> key_for(const char* font_path, uint32_t resolution) {
+    struct stat st;
+    if (stat(font_path, &st) == -1) {
+      fprintf(stderr, "err stat %s: %s\n", font_path, strerror(errno));
+      return {};
+    }
+    return Key{font_path, (int64_t)st.st_mtim.tv_sec, (int64_t)st.st_mtim.tv_nsec, (uint64_t)st.st_size, resolution};
+  }
+
+  // where the cache for the key is kept, in dir
+  static std::string path_for(const std::string& dir, const Key& key) {
+    char name[64];
+    snprintf(name, sizeof(name), "/glyphs-%016zx.cache", std::hash<std::string>{}(key.font_path));
+    return dir + name;
+  }
+
+  // empty if there's no cache for the key. a stale or corrupt cache is deleted (see valid)
+  static std::optional<GlyphCache> open(const std::string& path, const Key& key, uint16_t max_glyph_size) {
+    FileDescriptor fd(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) {
+      if (errno != ENOENT) {
+        fprintf(stderr, "err open %s: %s\n", path.c_str(), strerror(errno));
+      }
+      return {};
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      fprintf(stderr, "err stat %s: %s\n", path.c_str(), strerror(errno));
+      return {};
+    }
+    if (st.st_size == 0) {
+      unlink(path.c_str());
+      return {};
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      fprintf(stderr, "err mmap %s: %s\n", path.c_str(), strerror(errno));
+      return {};
+    }
+    GlyphCache ret((const char*)p, st.st_size);
+    if (!ret.valid(key, max_glyph_size)) {
+      // the font changed, or the file is from an older version, was cut short or is corrupt
+      unlink(path.c_str());
+      return {};
+    }
+    return ret;
+  }
+
+  // writes the cache to a temporary file, then renames it over path, so a reader never
+  // sees it half written. pixels are the entries' pixels. each entry's offset is into pixels
+  // (it's changed to be from the start of the file as it's written).
+  // false on failure (error printed)
+  static bool save(const std::string& path, const Key& key, std::vector<Entry> entries, const std::vector<uint32_t>& pixels) {
+    std::string tmp_path = path + ".XXXXXX";
+    FileDescriptor fd(mkstemp(tmp_path.data()));
+    if (!fd) {
+      fprintf(stderr, "err create %s: %s\n", tmp_path.c_str(), strerror(errno));
+      return false;
+    }
+
+    Header h;
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.resolution = key.resolution;
+    h.path_length = key.font_path.size();
+    h.mtime_sec = key.mtime_sec;
+    h.mtime_nsec = key.mtime_nsec;
+    h.font_size = key.font_size;
+    h.entry_count = entries.size();
+
+    size_t pixels_offset = entries_offset(h.path_length) + entries.size() * sizeof(Entry);
+    for (Entry& e : entries) {
+      e.offset += pixels_offset;
+    }
+    char padding[8] = {};
+    bool ok = write_all(fd, &h, sizeof(h)) &&                                                   //
+              write_all(fd, key.font_path.data(), key.font_path.size()) &&                      //
+              write_all(fd, padding, entries_offset(h.path_length) - sizeof(h) - h.path_length) && //
+              write_all(fd, entries.data(), entries.size() * sizeof(Entry)) &&                  //
+              write_all(fd, pixels.data(), pixels.size() * sizeof(uint32_t));
+    if (ok && rename(tmp_path.c_str(), path.c_str()) == -1) {
+      fprintf(stderr, "err rename %s: %s\n", tmp_path.c_str(), strerror(errno));
+      ok = false;
+    }
+    if (!ok) {
+      unlink(tmp_path.c_str());
+    }
+    return ok;
+  }
+
+  GlyphCache(const GlyphCache&) = delete;
+  GlyphCache& operator=(const GlyphCache&) = delete;
+  GlyphCache& operator=(GlyphCache&&) = delete;
+
+  GlyphCache(GlyphCache&& other) noexcept : mapping(other.mapping), mapped_size(other.mapped_size) {
+    other.mapping = NULL;
+    other.mapped_size = 0;
+  }
+
+  ~GlyphCache() {
+    if (mapping != NULL && munmap((void*)mapping, mapped_size) == -1) {
+      perror("err munmap glyph cache");
+    }
+  }
+
+  size_t size() const { return header().entry_count; }
+
+  const Entry& operator[](size_t i) const {
+    return ((const Entry*)(mapping + entries_offset(header().path_length)))[i];
+  }
+
+  // width * height ARGB8888 pixels, in rows
+  const uint32_t* pixels(const Entry& e) const { return (const uint32_t*)(mapping + e.offset); }
+};
@@ -4,19 +4,29 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <optional>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 #include <thread>
 
+#include "file_utils.hpp"
+#include "frame_utils.hpp"
+#include "ring_utils.hpp"
+#include "screen_utils.hpp"
+#include "scrollback_utils.hpp"
 #include "sdl_utils.hpp"
 #include "string_utils.hpp"
 
@@ -24,39 +34,258 @@ static const char* SHELL = "/bin/sh";
 
 #define TERM_NAME "not_named_yet"
 
-// raii wrapper of file descriptor
-class FileDescriptor {
-  int fd = -1;
+// the scrollback is bounded by whichever is reached first. past the memory limit
+// the oldest lines are spilled to a file. past the line limit they're evicted
+static constexpr size_t SCROLLBACK_MAX_LINES = 100000000;
+static constexpr size_t SCROLLBACK_MAX_BYTES = 64 * 1024 * 1024;
+// lines further back than this are compressed
+static constexpr size_t SCROLLBACK_HOT_LINES = 1024;
+
+// the shell's output is buffered this much ahead of parsing. past that, the shell blocks
+static constexpr size_t PTY_OUTPUT_CAPACITY = 1 << 20;
+// input is queued this much ahead of the shell reading it. past that, it waits in a backlog
+static constexpr size_t PTY_INPUT_CAPACITY = 64 * 1024;
+// the pty is read (and its output parsed) in pieces of this size. it grows while output
+// streams in and drops back once it's interactive (see AdaptiveSize)
+static constexpr size_t PTY_MIN_READ_SIZE = 256;
+static constexpr size_t PTY_MAX_READ_SIZE = 64 * 1024;
+// each main loop iteration parses at most this much output, for at most this long,
+// before handling events again. bigger is more throughput, smaller is more responsive
+static constexpr size_t PARSE_BYTE_BUDGET = 1 << 20;
+static constexpr std::chrono::milliseconds PARSE_TIME_BUDGET(8);
+
+// while the shell is writing continuously, the view is still presented at least this often
+static constexpr std::chrono::milliseconds MAX_FRAME_LATENCY(33);
+// while flooding (a screen's worth of rows scrolled by between frames), the view is
+// presented this often instead
+static constexpr std::chrono::milliseconds FLOOD_FRAME_INTERVAL(50);
+// a synchronized update (DEC mode 2026) holds presentation for at most this long
+static constexpr std::chrono::milliseconds SYNCHRONIZED_UPDATE_TIMEOUT(150);
+static constexpr uint16_t SYNCHRONIZED_UPDATE_MODE = 2026;
+// a size for reads, which doubles while reads fill it and drops back to the minimum
+// once they don't. large while output is streaming, small while it's interactive
+struct AdaptiveSize {
+  size_t min;
+  size_t max;
+  size_t current;
+
+  AdaptiveSize(size_t min, size_t max) : min(min), max(max), current(min) {}
+
+  // n of the current size was used
+  void used(size_t n) {
+    if (n >= current) {
+      current = std::min(current * 2, max);
+    } else if (n < current / 2) {
+      current = min;
+    }
+  }
+};
+
+// does the pty's io on its own thread, so the main thread never blocks on it.
+//
+// output is read into a ring that the main thread parses from. this way the shell can
+// keep writing while the main thread is busy (e.g. waiting on vsync). when the main
+// thread runs out of bytes it asks to be woken, and the next read pushes an SDL user
+// event, so the main loop can block on SDL events alone. when the ring is full the
+// thread stops reading until space is freed, and the pty's kernel buffer fills up and
+// blocks the shell.
+//
+// input is queued by the main thread in another ring, and written whenever the pty is
+// writable. if it's full (e.g. a large paste), the main thread asks to be woken once
+// there's space, with the same event
+class PTYIO {
+  // referenced by the thread. separate so this can be moved
+  struct Shared {
+    SPSCByteRing output; // written by the thread
+    SPSCByteRing input;  // written by the main thread
+    std::atomic<bool> output_wanted{false};       // set by the main thread when it ran out of output
+    std::atomic<bool> output_space_wanted{false}; // set by the thread when output is full
+    std::atomic<bool> input_wanted{false};        // set by the thread when it ran out of input
+    std::atomic<bool> input_space_wanted{false};  // set by the main thread when input is full
+    std::atomic<bool> closed{false};              // the shell shut down. set after the last output is in the ring
+    FileDescriptor wake_fd;                       // eventfd. wakes the thread after one of its requests
+    FileDescriptor stop_fd;                       // eventfd
+
+    Shared(size_t output_capacity, size_t input_capacity, FileDescriptor wake_fd, FileDescriptor stop_fd)
+        : output(output_capacity), input(input_capacity), wake_fd(std::move(wake_fd)), stop_fd(std::move(stop_fd)) {}
+  };
+
+  std::unique_ptr<Shared> shared;
+  std::thread thread;
+
+  PTYIO(std::unique_ptr<Shared> shared) : shared(std::move(shared)) {}
+
+  static void signal(int eventfd) {
+    uint64_t one = 1;
+    if (::write(eventfd, &one, sizeof(one)) < 0) {
+      perror("err write eventfd");
+    }
+  }
+
+  static void io_loop(int master, Shared& shared, Uint32 event_type) {
+    AdaptiveSize read_size(PTY_MIN_READ_SIZE, PTY_MAX_READ_SIZE);
+    // the shell hung up. what it wrote can still be read, but nothing more can be written.
+    // poll keeps reporting the hang up, so master isn't polled while there's nowhere to read to
+    bool hung_up = false;
+    while (1) {
+      // each request is checked again after it's made, since the other side might have
+      // acted before it saw the request
+      SPSCByteRing::Region region = shared.output.write_region();
+      if (region.size == 0) {
+        shared.output_space_wanted = true;
+        region = shared.output.write_region();
+      }
+      if (hung_up) {
+        // input is dropped, so the main thread never waits for space that won't come
+        shared.input.commit_read(shared.input.size());
+        if (shared.input_space_wanted.exchange(false)) {
+          push_event(event_type);
+        }
+      }
+      bool has_input = shared.input.size() != 0;
+      if (!has_input) {
+        shared.input_wanted = true;
+        has_input = shared.input.size() != 0;
+      }
+
+      // only wait to read if there's somewhere to put it, and to write if there's something to write
+      short events = (region.size != 0 ? POLLIN : 0) | (has_input ? POLLOUT : 0);
+      pollfd fds[3] = {{events != 0 ? master : -1, events, 0}, {shared.wake_fd, POLLIN, 0}, {shared.stop_fd, POLLIN, 0}};
+      if (poll(fds, 3, -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("err poll pty io");
+        break;
+      }
+      if (fds[2].revents) {
+        return;
+      }
+      if (fds[0].revents & (POLLHUP | POLLERR)) {
+        hung_up = true;
+      }
+      if (fds[1].revents) {
+        uint64_t count;
+        if (read(shared.wake_fd, &count, sizeof(count)) < 0) {
+          perror("err read eventfd");
+        }
+      }
+
+      if (fds[0].revents & POLLOUT) { // ================ write input ==========
+        // both sides of the wrap point in one call
+        SPSCByteRing::Region regions[2];
+        size_t region_count = shared.input.read_regions(regions);
+        iovec iov[2];
+        for (size_t i = 0; i < region_count; ++i) {
+          iov[i] = iovec{regions[i].data, regions[i].size};
+        }
+        ssize_t bytes_written = writev(master, iov, region_count);
+        if (bytes_written < 0) {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("write pts");
+            break;
+          }
+        } else {
+          shared.input.commit_read(bytes_written);
+          if (shared.input_space_wanted.exchange(false)) {
+            push_event(event_type);
+          }
+        }
+      }
+
+      if (fds[0].revents & (POLLIN | POLLHUP | POLLERR) && region.size != 0) { // ================ read output ==========
+        size_t length = std::min(region.size, read_size.current);
+        ssize_t bytes_read = read(master, region.data, length);
+        if (bytes_read < 0) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            continue;
+          }
+          if (errno != EIO) { // EIO: shell shut down
+            perror("read pts");
+          }
+          break;
+        }
+        if (bytes_read == 0) {
+          break; // shell shut down
+        }
+        shared.output.commit_write(bytes_read);
+        if (length == read_size.current) { // not limited by space in the ring
+          read_size.used(bytes_read);
+        }
+        if (shared.output_wanted.exchange(false)) {
+          push_event(event_type);
+        }
+      }
+    }
+    shared.closed = true;
+    push_event(event_type);
+  }
 
  public:
-  FileDescriptor(const char* path, int flags) noexcept : fd(::open(path, flags)) {}
+  // empty for failure: error reason printed.
+  // event_type is pushed when there's output after wait_for_output, or space for input after wait_for_input_space
+  static std::optional<PTYIO> create(int master, size_t output_capacity, size_t input_capacity, Uint32 event_type) {
+    FileDescriptor wake_fd(eventfd(0, EFD_CLOEXEC));
+    FileDescriptor stop_fd(eventfd(0, EFD_CLOEXEC));
+    if (!wake_fd || !stop_fd) {
+      perror("err eventfd");
+      return {};
+    }
+    PTYIO ret(std::make_unique<Shared>(output_capacity, input_capacity, std::move(wake_fd), std::move(stop_fd)));
+    ret.thread = std::thread(io_loop, master, std::ref(*ret.shared), event_type);
+    return ret;
+  }
 
-  FileDescriptor(const FileDescriptor&) = delete;
-  FileDescriptor& operator=(const FileDescriptor&) = delete;
-  FileDescriptor& operator=(FileDescriptor&& other) = delete;
+  PTYIO(PTYIO&&) = default;
 
-  FileDescriptor(FileDescriptor&& other) noexcept : fd(other.fd) { //
-    other.fd = -1;
+  // ================ output
+
+  // the next bytes the shell wrote, in place. empty if there aren't any yet
+  SPSCByteRing::Region readable() const { return shared->output.read_region(); }
+
+  // n bytes of readable() were used
+  void consumed(size_t n) {
+    shared->output.commit_read(n);
+    if (shared->output_space_wanted.exchange(false)) {
+      signal(shared->wake_fd);
+    }
   }
 
-  explicit operator bool() const noexcept { return this->fd != -1; }
-  operator int() const noexcept { return this->fd; }
+  // call when readable() is empty. true if it's still empty, in which case an event
+  // will be pushed once there's more. false if more arrived in the meantime
+  bool wait_for_output() {
+    shared->output_wanted = true;
+    return shared->output.size() == 0 && !shared->closed;
+  }
+
+  // the shell shut down, and everything it wrote has been read
+  bool finished() const { return shared->closed && shared->output.size() == 0; }
+
+  // the shell shut down. nothing more will be written to it
+  bool closed() const { return shared->closed; }
 
-  // only explicitly close when necessary.
-  // otherwise, allow dtor to close.
-  bool close() noexcept {
-    if (*this) {
-      bool close_success = ::close(*this) != -1;
-      this->fd = -1;
-      return close_success;
+  // ================ input
+
+  // queues bytes to be written to the shell. returns how many fit
+  size_t write(const char* data, size_t length) {
+    size_t n = shared->input.push(data, length);
+    if (n != 0 && shared->input_wanted.exchange(false)) {
+      signal(shared->wake_fd);
     }
-    return true;
+    return n;
   }
 
-  ~FileDescriptor() {
-    if (!close()) {
-      // log failure. no other action required or available given dtor context
-      perror("err fd close");
+  // call when write didn't fit everything. true if there's still no space, in which
+  // case an event will be pushed once there is. false if space was freed in the meantime
+  bool wait_for_input_space() {
+    shared->input_space_wanted = true;
+    return shared->input.size() == shared->input.get_capacity() && !shared->closed;
+  }
+
+  ~PTYIO() {
+    if (thread.joinable()) {
+      signal(shared->stop_fd);
+      thread.join();
     }
   }
 };
@@ -171,99 +400,488 @@ class PTY {
       return false;
     }
 
-    std::optional<CharacterManager> maybe_cm = CharacterManager::create(sdl_context);
+    // pushed when glyphs have been rasterized, and can be uploaded
+    Uint32 glyphs_ready_event = SDL_RegisterEvents(1);
+    if (glyphs_ready_event == (Uint32)-1) {
+      fprintf(stderr, "err register event: %s\n", SDL_GetError());
+      return false;
+    }
+    std::optional<CharacterManager> maybe_cm = CharacterManager::create(sdl_context, renderer, glyphs_ready_event, get_cache_dir(TERM_NAME));
     if (!maybe_cm) {
       return false;
     }
-    CharacterManager& character_manager = *maybe_cm; // texture cache for character rendering
+    CharacterManager& character_manager = *maybe_cm; // glyph atlases for character rendering
+    QuadBatch quad_batch;                            // what's drawn this frame, submitted all at once
+
+    // the view is drawn here rather than to the window directly. it keeps its contents
+    // between frames, so only what changed needs to be drawn. it's copied to the window
+    // each frame something was drawn
+    TexturePtr view_texture = create_render_target(renderer, SCREEN_WIDTH, SCREEN_HEIGHT);
+    if (!view_texture) {
+      return false;
+    }
 
     BlockStream block_stream;
 
-    // the lines to display in the terminal
-    std::vector<std::vector<Cell>> lines;
-    lines.emplace_back(); // lines will never by empty
+    AttributeTable attribute_table; // the colors referenced by cells
+
+    // the grids that the shell writes to. the alternate screen is used by full screen
+    // applications (e.g. vim). it has no scrollback, and leaves the primary screen as it
+    // was. switching between them is a pointer swap, and each keeps its own saved cursor
+    Screen primary_screen(CELLS_PER_WIDTH, CELLS_PER_HEIGHT);
+    Screen alternate_screen(CELLS_PER_WIDTH, CELLS_PER_HEIGHT);
+    Screen* screen = &primary_screen;
+    // the rows that have scrolled off the top of the primary screen
+    Scrollback scrollback({SCROLLBACK_MAX_LINES, SCROLLBACK_MAX_BYTES, SCROLLBACK_HOT_LINES, true}, CELLS_PER_WIDTH);
 
     CellAttributes cursor_attributes;
-    // position of where text received from the shell will be drawn next
-    int cursor_x = 0; // pixels (right from left of screen)
-    int cursor_y = 0; // pixels (down from top of screen)
-
-    // position in lines for when the entire screen is redrawn
-    // terminology is confusing. a "line" (std::vector<Cell>) is broken by newline chars received by the shell.
-    // however, the line itself is broken up into lines visually when text wrapping occurs.
-    // lines[start_line][start_cell] is where drawing starts at the top left of the screen
-    int start_line = 0;
-    int start_cell = 0;
-
-    // this is the position in lines where text is currently inserted. unlike cursor position,
-    // it is not effected by screen wrapping
-    int insert_line_pos = 0;
-    int insert_cell_pos = 0;
-
-    std::vector<char> master_write_q; // used by write_txt_to_shell
-
-    // a helper lambda. if all the data hasn't been written by write syscall, rather
-    // than looping until it's finished writing, it gets put on a queue which is
-    // written first on subsequent calls. this ensures calling has bounded time
-    auto write_txt_to_shell = [&](const char* text, size_t length) -> bool {
-      // returns negative value on error (error printed)
-      auto do_write = [&](const char* text, size_t length) -> ssize_t {
-        ssize_t bytes_written = write(this->master, text, length);
-        if (bytes_written < 0) {
-          if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            bytes_written = 0; // no bytes written
-          } else {
-            perror("write pts"); // negative return handled by callee
-          }
+    uint32_t cursor_flags = 0; // bold, italic, underline
+    // cursor_attributes as an id in attribute_table. reset whenever cursor_attributes
+    // changes, and looked up again on the next written cell
+    std::optional<uint16_t> cursor_attributes_id;
+
+    // what's displayed. when following, it's the screen. otherwise the view has been
+    // scrolled back and scrollback[start_line] is drawn at the top, starting from
+    // start_cell (a multiple of CELLS_PER_WIDTH, since lines are wrapped when drawn).
+    // the screen's rows are drawn after the last line of the scrollback.
+    // start_line is an absolute line number, so it stays put as lines are added or evicted
+    bool following = true;
+    size_t start_line = 0;
+    size_t start_cell = 0;
+
+    bool full_redraw_required = true; // set when the entire view needs to be redrawn. otherwise only damaged screen rows are
+    bool present_required = false;    // set when the window needs view_texture copied to it again
+
+    FrameScheduler frame_scheduler(get_refresh_interval(w), MAX_FRAME_LATENCY, FLOOD_FRAME_INTERVAL, SYNCHRONIZED_UPDATE_TIMEOUT);
+    size_t rows_scrolled = 0; // since the last frame. used to detect flooding
+
+    // pushed when the shell has written something. the main loop only wakes for events
+    Uint32 pty_readable_event = SDL_RegisterEvents(1);
+    if (pty_readable_event == (Uint32)-1) {
+      fprintf(stderr, "err register event: %s\n", SDL_GetError());
+      return false;
+    }
+    std::optional<PTYIO> io = PTYIO::create(master, PTY_OUTPUT_CAPACITY, PTY_INPUT_CAPACITY, pty_readable_event);
+    if (!io) {
+      return false;
+    }
+    bool output_pending = true; // the shell has written something that hasn't been parsed yet
+    AdaptiveSize parse_size(PTY_MIN_READ_SIZE, PTY_MAX_READ_SIZE);
+
+    // input that didn't fit in io's queue yet (e.g. a large paste). it's moved over as
+    // space is freed. written from input_backlog_offset
+    std::vector<char> input_backlog;
+    size_t input_backlog_offset = 0;
+
+    auto flush_input_backlog = [&]() {
+      while (!input_backlog.empty()) {
+        size_t n = io->write(input_backlog.data() + input_backlog_offset, input_backlog.size() - input_backlog_offset);
+        input_backlog_offset += n;
+        if (n == 0 && io->closed()) {
+          // the io thread has stopped, so the queue will never have space again
+          input_backlog.clear();
+          input_backlog_offset = 0;
+        } else if (input_backlog_offset == input_backlog.size()) {
+          input_backlog.clear();
+          input_backlog_offset = 0;
+        } else if (io->wait_for_input_space()) {
+          break; // continued on the next event
+        }
+      }
+    };
+
+    // never blocks. the text is written by the io thread, in order
+    auto write_txt_to_shell = [&](const char* text, size_t length) {
+      if (io->closed()) {
+        return; // there's no shell to write to
+      }
+      if (input_backlog.empty()) {
+        size_t n = io->write(text, length);
+        text += n;
+        length -= n;
+      }
+      if (length != 0) {
+        append_to_buffer(input_backlog, text, text + length);
+        flush_input_backlog();
+      }
+    };
+
+    auto get_cursor_attributes_id = [&]() -> uint16_t {
+      if (!cursor_attributes_id) {
+        cursor_attributes_id = attribute_table.intern(cursor_attributes, [&](auto mark) {
+          // the table is full and is being compacted. ids might be reused after this
+          primary_screen.for_each_cell([&](const Cell& cell) { mark(cell.attributes); });
+          alternate_screen.for_each_cell([&](const Cell& cell) { mark(cell.attributes); });
+          scrollback.for_each_attribute_id(mark);
+        });
+      }
+      return *cursor_attributes_id;
+    };
+
+    // erased cells and rows that enter the screen take on the current background
+    auto blank = [&]() { return Cell::blank(get_cursor_attributes_id()); };
+
+    // what the view is cleared to. cells with this background don't fill anything
+    const Color default_bg = CellAttributes().bg;
+
+    // adds length cells to the batch, starting at the row and column (in cells) of the view.
+    // the area must already be cleared to default_bg. nothing is drawn until the batch is flushed
+    auto render_cells = [&](unsigned int row, unsigned int col, const Cell* cells, size_t length) {
+      int y = row * CELL_HEIGHT;
+      // adjacent cells with the same background are filled as one span
+      size_t span_start = 0;
+      Color span_bg = default_bg;
+      auto end_span = [&](size_t end) {
+        if (span_bg != default_bg && end != span_start) {
+          SDL_Rect dst{(int)((col + span_start) * CELL_WIDTH), y, (int)((end - span_start) * CELL_WIDTH), CELL_HEIGHT};
+          quad_batch.fill(dst, SDL_Color{span_bg.r, span_bg.g, span_bg.b, 255});
         }
-        return bytes_written;
       };
 
-      if (master_write_q.empty()) { // ================ no text is backed up ==========
-        ssize_t bytes_written = do_write(text, length);
-        if (bytes_written < 0) {
-          return false;
+      for (size_t i = 0; i < length; ++i) {
+        const Cell& cell = cells[i];
+        const CellAttributes& attributes = attribute_table[cell.attributes];
+        if (attributes.bg != span_bg) {
+          end_span(i);
+          span_start = i;
+          span_bg = attributes.bg;
         }
-        if (bytes_written != length) {
-          text += bytes_written;
-          length -= bytes_written;
-          append_to_buffer(master_write_q, text, text + length);
+        // the glyph is resolved here rather than being stored in each cell
+        const Glyph* glyph = cell.code_point < 128 ? character_manager.get_ascii(cell.code_point) //
+                                                   : character_manager.get(cell.code_point);
+        SDL_Rect dst{(int)((col + i) * CELL_WIDTH), y, CELL_WIDTH, CELL_HEIGHT};
+        quad_batch.copy(*glyph, dst, SDL_Color{attributes.fg.r, attributes.fg.g, attributes.fg.b, 255});
+      }
+      end_span(length);
+    };
+
+    auto redraw = [&]() {
+      SDL_SetRenderDrawColor(renderer.get(), default_bg.r, default_bg.g, default_bg.b, 255);
+      SDL_RenderClear(renderer.get());
+
+      unsigned int view_row = 0;
+      if (!following) {
+        for (size_t line_index = start_line; line_index < scrollback.end_line() && view_row < CELLS_PER_HEIGHT; ++line_index) {
+          LineView line = scrollback[line_index];
+          size_t cell_index = line_index == start_line ? start_cell : 0;
+          assert(cell_index <= line.size);
+          do {
+            render_cells(view_row, 0, line.data + cell_index, std::min<size_t>(CELLS_PER_WIDTH, line.size - cell_index));
+            cell_index += CELLS_PER_WIDTH;
+            view_row += 1;
+          } while (cell_index < line.size && view_row < CELLS_PER_HEIGHT);
         }
-      } else { // ==================================== text is backed up ==============
-        append_to_buffer(master_write_q, text, text + length);
-        ssize_t bytes_written = do_write(master_write_q.data(), master_write_q.size());
-        if (bytes_written < 0) {
+      }
+
+      for (unsigned int screen_row = 0; view_row < CELLS_PER_HEIGHT; ++screen_row, ++view_row) {
+        render_cells(view_row, 0, screen->row(screen_row), CELLS_PER_WIDTH);
+      }
+      quad_batch.flush(renderer);
+      screen->clear_damage();
+    };
+
+    // called by the screen for each row that scrolls off the top
+    auto on_scroll_off = [&](const Cell* row, unsigned int width, bool wrapped) {
+      rows_scrolled += 1;
+      if (screen == &alternate_screen) {
+        return; // no scrollback
+      }
+      scrollback.push_row(row, width, wrapped);
+      if (!following) {
+        if (start_line < scrollback.begin_line()) {
+          // the top of the view was evicted
+          start_line = scrollback.begin_line();
+          start_cell = 0;
+        }
+        // the lines in the view might have moved. when following the screen's damage covers it
+        full_redraw_required = true;
+      }
+    };
+
+    auto insert_cell = [&](char32_t code_point) {
+      Cell cell{code_point, cursor_flags, get_cursor_attributes_id()};
+      screen->put(cell, blank(), on_scroll_off);
+    };
+
+    // same as insert_cell, but writes a whole run of ascii. one pass per row
+    auto insert_ascii_run = [&](const char* data, size_t length) {
+      uint16_t attributes = get_cursor_attributes_id();
+      while (length != 0) {
+        size_t n = screen->put_ascii(data, length, cursor_flags, attributes, Cell::blank(attributes), on_scroll_off);
+        data += n;
+        length -= n;
+      }
+    };
+
+    // the position of the top of the view, in visual rows of the scrollback.
+    // the screen starts at row_count()
+    auto view_position = [&]() -> size_t {
+      return following ? scrollback.row_count() : scrollback.row_of(start_line) + start_cell / CELLS_PER_WIDTH;
+    };
+
+    // O(log n) in the scrollback size, so jumping far is the same as scrolling a bit
+    auto scroll_view_to = [&](size_t row) {
+      if (row >= scrollback.row_count()) {
+        following = true;
+      } else {
+        following = false;
+        Scrollback::Position p = scrollback.position_of_row(row);
+        start_line = p.line;
+        start_cell = p.cell;
+      }
+      full_redraw_required = true;
+    };
+
+    auto scroll_view_by = [&](ptrdiff_t rows) {
+      size_t position = view_position();
+      scroll_view_to(rows < 0 && (size_t)-rows > position ? 0 : position + rows);
+    };
+
+    // draws the screen rows that changed since they were last drawn. O(damaged rows).
+    // returns true if anything was drawn
+    auto redraw_damaged = [&]() -> bool {
+      unsigned int first_view_row = 0; // where the screen starts in the view
+      if (!following) {
+        size_t scrollback_rows = scrollback.row_count() - view_position();
+        if (scrollback_rows >= CELLS_PER_HEIGHT) {
+          screen->clear_damage(); // the screen is scrolled out of the view
           return false;
         }
-        // remove the written bytes from the q
-        master_write_q.erase(master_write_q.begin(), master_write_q.begin() + bytes_written);
+        first_view_row = scrollback_rows;
+      }
+      // the damaged rows are cleared first, since the fills are drawn in the order their colors were first used.
+      // adjacent damaged rows are cleared as one rect
+      unsigned int visible_rows = CELLS_PER_HEIGHT - first_view_row;
+      for (unsigned int screen_row = 0; screen_row < visible_rows;) {
+        if (!screen->is_damaged(screen_row)) {
+          ++screen_row;
+          continue;
+        }
+        unsigned int end = screen_row + 1;
+        while (end < visible_rows && screen->is_damaged(end)) {
+          ++end;
+        }
+        SDL_Rect dst{0, (int)((first_view_row + screen_row) * CELL_HEIGHT), SCREEN_WIDTH, (int)((end - screen_row) * CELL_HEIGHT)};
+        quad_batch.fill(dst, SDL_Color{default_bg.r, default_bg.g, default_bg.b, 255});
+        screen_row = end;
+      }
+
+      bool drawn = false;
+      for (unsigned int screen_row = 0; screen_row < visible_rows; ++screen_row) {
+        if (screen->is_damaged(screen_row)) {
+          render_cells(first_view_row + screen_row, 0, screen->row(screen_row), CELLS_PER_WIDTH);
+          drawn = true;
+        }
+      }
+      quad_batch.flush(renderer);
+      screen->clear_damage();
+      return drawn;
+    };
+
+    auto save_cursor = [&]() {
+      screen->saved_cursor = screen->cursor;
+      screen->saved_attributes = cursor_attributes;
+      screen->saved_flags = cursor_flags;
+    };
+
+    auto load_cursor = [&]() {
+      screen->cursor = screen->saved_cursor;
+      cursor_attributes = screen->saved_attributes;
+      cursor_attributes_id.reset();
+      cursor_flags = screen->saved_flags;
+    };
+
+    // O(1) apart from the redraw. the cursor is shared between the screens
+    auto switch_screen = [&](Screen* to) {
+      if (to == screen) {
+        return;
+      }
+      to->cursor = screen->cursor;
+      screen = to;
+      screen->damage_all();
+      following = true;
+      full_redraw_required = true;
+    };
+
+    // the number of times to repeat a cursor movement. 0 is the default, which is 1
+    auto count = [](uint16_t n) -> int { return n == 0 ? 1 : n; };
+
+    // applies each block to the screen as it's parsed. no intermediate container.
+    // this only updates state (no SDL calls). what's visible is drawn once per frame
+    auto apply_block = [&](const auto& blk) {
+      using BlockType = std::decay_t<decltype(blk)>;
+      const Screen::Cursor& c = screen->cursor;
+      if constexpr (std::is_same_v<BlockType, ASCIIRun>) {
+        insert_ascii_run(blk.data, blk.length);
+      } else if constexpr (std::is_same_v<BlockType, CodePointBlock>) {
+        if (blk.code_point == '\n') {
+          screen->line_feed(blank(), on_scroll_off);
+        } else if (blk.code_point == '\a') {
+          // no beep implemented
+        } else if (blk.code_point == '\b') {
+          screen->backspace();
+        } else if (blk.code_point == '\r') {
+          screen->carriage_return();
+        } else if (blk.code_point == '\t') {
+          screen->tab();
+        } else if (blk.code_point < ' ' || blk.code_point == 0x7F) {
+          // ignore other control characters
+        } else {
+          insert_cell(blk.code_point);
+        }
+      } else if constexpr (std::is_same_v<BlockType, ANSICursorUp>) {
+        screen->move_cursor((int)c.row - count(blk.n), c.col);
+      } else if constexpr (std::is_same_v<BlockType, ANSICursorDown>) {
+        screen->move_cursor((int)c.row + count(blk.n), c.col);
+      } else if constexpr (std::is_same_v<BlockType, ANSICursorForward>) {
+        screen->move_cursor(c.row, (int)c.col + count(blk.n));
+      } else if constexpr (std::is_same_v<BlockType, ANSICursorBack>) {
+        screen->move_cursor(c.row, (int)c.col - count(blk.n));
+      } else if constexpr (std::is_same_v<BlockType, ANSICursorNextLine>) {
+        screen->move_cursor((int)c.row + count(blk.n), 0);
+      } else if constexpr (std::is_same_v<BlockType, ANSICursorPreviousLine>) {
+        screen->move_cursor((int)c.row - count(blk.n), 0);
+      } else if constexpr (std::is_same_v<BlockType, ANSICursorHorizontalAbsolute>) {
+        screen->move_cursor(c.row, count(blk.n) - 1);
+      } else if constexpr (std::is_same_v<BlockType, ANSICursorPosition>) {
+        screen->move_cursor(count(blk.row) - 1, count(blk.col) - 1); // 1 based
+      } else if constexpr (std::is_same_v<BlockType, ANSIEraseDisplay>) {
+        if (blk.type == 3) {
+          // the scrollback
+          scrollback.clear();
+          following = true;
+          full_redraw_required = true;
+        } else {
+          screen->erase_display(blk.type, blank());
+        }
+      } else if constexpr (std::is_same_v<BlockType, ANSIEraseLine>) {
+        screen->erase_line(blk.type, blank());
+      } else if constexpr (std::is_same_v<BlockType, ANSIScrollUp>) {
+        screen->scroll_up(count(blk.n), blank(), on_scroll_off);
+      } else if constexpr (std::is_same_v<BlockType, ANSIScrollDown>) {
+        screen->scroll_down(count(blk.n), blank());
+      } else if constexpr (std::is_same_v<BlockType, ANSISaveCursor>) {
+        save_cursor();
+      } else if constexpr (std::is_same_v<BlockType, ANSILoadCursor>) {
+        load_cursor();
+      } else if constexpr (std::is_same_v<BlockType, ANSIGraphicsForeground>) {
+        cursor_attributes.fg = blk.c;
+        cursor_attributes_id.reset();
+      } else if constexpr (std::is_same_v<BlockType, ANSIGraphicsBackground>) {
+        cursor_attributes.bg = blk.c;
+        cursor_attributes_id.reset();
+      } else if constexpr (std::is_same_v<BlockType, ANSIGraphicsReset>) {
+        cursor_attributes = CellAttributes();
+        cursor_attributes_id = AttributeTable::DEFAULT_ID;
+        cursor_flags = 0;
+      } else if constexpr (std::is_same_v<BlockType, ANSIGraphicsBold>) {
+        cursor_flags |= CELL_BOLD;
+      } else if constexpr (std::is_same_v<BlockType, ANSIGraphicsItalic>) {
+        cursor_flags |= CELL_ITALIC;
+      } else if constexpr (std::is_same_v<BlockType, ANSIGraphicsUnderline>) {
+        cursor_flags |= CELL_UNDERLINE;
+      } else if constexpr (std::is_same_v<BlockType, ANSIPrivateMode>) {
+        if (blk.mode == SYNCHRONIZED_UPDATE_MODE) {
+          // the application is redrawing. nothing in between is presented
+          if (blk.set) {
+            frame_scheduler.hold(FrameScheduler::Clock::now());
+          } else {
+            frame_scheduler.release();
+          }
+        } else if (blk.mode == 1049) {
+          // alternate screen, saving the cursor before and restoring it after. cleared on entry
+          if (blk.set) {
+            save_cursor();
+            switch_screen(&alternate_screen);
+            screen->erase_display(2, blank());
+          } else {
+            switch_screen(&primary_screen);
+            load_cursor();
+          }
+        } else if (blk.mode == 1047) {
+          // alternate screen, cleared on exit
+          if (blk.set) {
+            switch_screen(&alternate_screen);
+          } else if (screen == &alternate_screen) {
+            screen->erase_display(2, blank());
+            switch_screen(&primary_screen);
+          }
+        } else if (blk.mode == 47) {
+          switch_screen(blk.set ? &alternate_screen : &primary_screen);
+        }
+      } else if constexpr (std::is_same_v<BlockType, ANSIPrivateModeRequest>) {
+        // DECRPM. 0: not recognized, 1: set, 2: reset
+        int value = 0;
+        if (blk.mode == SYNCHRONIZED_UPDATE_MODE) {
+          value = frame_scheduler.is_held() ? 1 : 2;
+        }
+        char reply[32];
+        int length = snprintf(reply, sizeof(reply), "\x1b[?%u;%d$y", (unsigned int)blk.mode, value);
+        write_txt_to_shell(reply, length);
       }
-      return true;
     };
 
-    auto render_cell = [&](int x, int y, const Cell& cell) {
-      SDL_Texture* texture = cell.texture;
-      SDL_Rect dst{x, y, CELL_WIDTH, CELL_HEIGHT};
-      // background
-      SDL_SetRenderDrawColor(renderer.get(), cell.attributes.bg.r, cell.attributes.bg.g, cell.attributes.bg.b, 255);
-      SDL_RenderFillRect(renderer.get(), &dst);
-      // foreground
-      SDL_SetTextureColorMod(texture, cell.attributes.fg.r, cell.attributes.fg.g, cell.attributes.fg.b);
-      SDL_RenderCopy(renderer.get(), texture, NULL, &dst);
+    // tells the frame scheduler if anything visible changed since the last frame
+    auto note_changes = [&]() {
+      if (full_redraw_required || present_required || screen->any_damaged()) {
+        frame_scheduler.changed(FrameScheduler::Clock::now());
+      }
     };
 
     while (1) { // main loop
-      bool full_redraw_required = false;
-      SDL_Event event;                        // ============================ SDL handle event ===============
-      unsigned int poll_event_per_iter = 100; // ensure main loop is bounded
-      while (--poll_event_per_iter && SDL_PollEvent(&event)) {
-        if (event.type == SDL_QUIT) {
+      // ============================ wait for something to do ===============
+      // blocks until there's an event (including the shell writing something), or until
+      // a frame is due. idle, nothing wakes up
+      int timeout = -1; // forever
+      if (output_pending) {
+        timeout = 0;
+      } else {
+        auto until_due = frame_scheduler.time_until_due(FrameScheduler::Clock::now());
+        if (until_due != FrameScheduler::Clock::duration::max()) {
+          timeout = std::chrono::ceil<std::chrono::milliseconds>(until_due).count();
+        }
+      }
+
+      SDL_Event event; // ============================ SDL handle event ===============
+      bool has_event = SDL_WaitEventTimeout(&event, timeout);
+      // ensure main loop is bounded
+      for (unsigned int i = 0; has_event && i < 100; ++i, has_event = SDL_PollEvent(&event)) {
+        if (event.type == pty_readable_event) {
+          output_pending = true;
+          flush_input_backlog();
+        } else if (event.type == glyphs_ready_event) {
+          if (character_manager.upload_finished(renderer)) {
+            full_redraw_required = true; // wherever the placeholders were drawn
+          }
+        } else if (event.type == SDL_QUIT) {
           goto break_topmost;
         } else if (event.type == SDL_TEXTINPUT) {
-          if (!write_txt_to_shell(event.text.text, strlen(event.text.text))) {
-            goto break_topmost; // error already printed
-          }
+          write_txt_to_shell(event.text.text, strlen(event.text.text));
         } else if (event.type == SDL_KEYDOWN) {
+          if (event.key.keysym.mod & KMOD_SHIFT && screen == &primary_screen) { // scrolls the scrollback
+            bool scrolled = true;
+            switch (event.key.keysym.sym) {
+              case SDLK_PAGEUP:
+                scroll_view_by(-(ptrdiff_t)CELLS_PER_HEIGHT);
+                break;
+              case SDLK_PAGEDOWN:
+                scroll_view_by(CELLS_PER_HEIGHT);
+                break;
+              case SDLK_HOME:
+                scroll_view_to(0);
+                break;
+              case SDLK_END:
+                scroll_view_to(scrollback.row_count());
+                break;
+              default:
+                scrolled = false;
+                break;
+            }
+            if (scrolled) {
+              continue;
+            }
+          }
+
           // text input is for text only. it doesn't work for things like backspace or enter
           char simple_typed = '\0';
           switch (event.key.keysym.sym) {
@@ -277,207 +895,85 @@ class PTY {
           }
 
           if (simple_typed != '\0') {
-            if (!write_txt_to_shell(&simple_typed, 1)) {
-              goto break_topmost; // error already printed
-            }
+            write_txt_to_shell(&simple_typed, 1);
           }
         } else if (event.type == SDL_MOUSEWHEEL) {
-          // assuming each character spans 1 cell. not true in reality, but this is ignored
-          if (event.wheel.y < 0) { // scroll down
-            for (int i = 0; i < -event.wheel.y; ++i) {
-              start_cell += CELLS_PER_WIDTH;
-              cursor_y -= CELL_HEIGHT;
-              if (start_line < 0 || start_line >= lines.size() || start_cell >= lines[start_line].size()) {
-                start_line += 1;
-                start_cell = 0;
-              }
-            }
-          } else { // scroll up
-            // negative scroll is scroll up
-            for (int i = 0; i < event.wheel.y; ++i) {
-              start_cell -= CELLS_PER_WIDTH;
-              cursor_y += CELL_HEIGHT;
-              if (start_cell < 0) {
-                start_line -= 1;
-                if (start_line < 0 || start_line >= lines.size()) {
-                  start_cell = 0;
-                } else {
-                  if (CELLS_PER_WIDTH == 0) {
-                    start_cell = 0;
-                  } else {
-                    start_cell = (lines[start_line].size() / CELLS_PER_WIDTH) * CELLS_PER_WIDTH;
-                  }
-                }
-              }
-            }
+          // each step moves the view by one row. the alternate screen has no scrollback
+          if (screen == &primary_screen) {
+            scroll_view_by(-event.wheel.y);
           }
-          full_redraw_required = true;
+        } else if (event.type == SDL_RENDER_TARGETS_RESET || event.type == SDL_RENDER_DEVICE_RESET) {
+          full_redraw_required = true; // view_texture's contents were lost
+        } else if (event.type == SDL_WINDOWEVENT) {
+          present_required = true; // e.g. the window was exposed
         } else {
           // TODO other events like window resize handling
         }
       }
 
-      if (full_redraw_required) {
-        SDL_RenderClear(renderer.get());
-        int redraw_cursor_x = 0; // pixels
-        int redraw_cursor_y = 0;
-
-        int line_index = start_line;
-        while (1) {
-          if (line_index >= 0 && line_index < lines.size()) {
-            const std::vector<Cell>& line = lines[line_index];
-            assert(start_cell >= 0);
-            for (int cell_index = line_index == start_line ? start_cell : 0; cell_index < line.size(); ++cell_index) {
-              render_cell(redraw_cursor_x, redraw_cursor_y, line[cell_index]);
-              redraw_cursor_x += CELL_WIDTH;
-              if (redraw_cursor_x >= SCREEN_WIDTH) {
-                redraw_cursor_x = 0;
-                redraw_cursor_y += CELL_HEIGHT;
-                if (redraw_cursor_y >= SCREEN_HEIGHT) {
-                  goto break_full_redraw;
-                }
-              }
-            }
+      note_changes();
+
+      // ============= parse pts output ===========
+      // parse everything the io thread has buffered, rather than a buffer per frame.
+      // stops early if a frame is due while output keeps coming, or if the budget
+      // runs out (so events are handled)
+      size_t parse_budget = PARSE_BYTE_BUDGET;
+      FrameScheduler::Clock::time_point parse_deadline = FrameScheduler::Clock::now() + PARSE_TIME_BUDGET;
+      while (output_pending) {
+        SPSCByteRing::Region output = io->readable();
+        if (output.size == 0) {
+          if (io->finished()) {
+            goto break_topmost; // shell shut down
           }
-          ++line_index;
-          redraw_cursor_y += CELL_HEIGHT;
-          redraw_cursor_x = 0;
-          if (redraw_cursor_y >= SCREEN_HEIGHT) {
-            break;
+          if (io->wait_for_output()) {
+            output_pending = false;
           }
+          continue;
         }
-break_full_redraw:
-        SDL_RenderPresent(renderer.get());
-      }
-
-      static constexpr size_t BUF_MAX_SIZE = 256; // ============= pts read ===========
-      char buffer[BUF_MAX_SIZE];
-      ssize_t bytes_read = read(master, buffer, BUF_MAX_SIZE);
-      if (bytes_read < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          bytes_read = 0;
-        } else if (errno == EIO) {
-          break; // shell shut down
-        } else {
-          perror("read pts");
+        size_t length = std::min(output.size, parse_size.current);
+        block_stream.consume(output.data, length, apply_block);
+        io->consumed(length);
+        parse_size.used(length);
+        note_changes();
+        FrameScheduler::Clock::time_point now = FrameScheduler::Clock::now();
+        if (frame_scheduler.should_present(now, true)) {
           break;
         }
+        if (length >= parse_budget || now >= parse_deadline) {
+          break;
+        }
+        parse_budget -= length;
       }
 
-      std::vector<Block> blocks = block_stream.consume(buffer, bytes_read);
-
-      // helper lambda
-      auto insert_cell = [&](Cell cell) {
-        render_cell(cursor_x, cursor_y, cell);
-        cursor_x += CELL_WIDTH; // move to next position
-        if (cursor_x >= SCREEN_WIDTH) {
-          cursor_x = 0;
-          cursor_y += CELL_HEIGHT;
+      FrameScheduler::Clock::time_point now = FrameScheduler::Clock::now(); // ============= draw ===========
+      if (frame_scheduler.should_present(now, output_pending)) {
+        if (SDL_SetRenderTarget(renderer.get(), view_texture.get()) != 0) {
+          fprintf(stderr, "err set render target: %s\n", SDL_GetError());
+          break;
         }
-
-        assert(insert_line_pos >= 0 && insert_line_pos < lines.size());
-        while (insert_cell_pos >= lines[insert_line_pos].size()) {
-          // insert a default space until we reach the position in this line
-          lines[insert_line_pos].push_back({character_manager.get(UTF8Block::space(), renderer), CellAttributes()});
+        if (full_redraw_required) {
+          redraw();
+          present_required = true;
+        } else if (redraw_damaged()) {
+          present_required = true;
         }
-
-        assert(insert_cell_pos >= 0 && insert_cell_pos < lines[insert_line_pos].size());
-        lines[insert_line_pos][insert_cell_pos] = cell; // replace
-        insert_cell_pos += 1;
-      };
-
-      if (!blocks.empty()) {
-        for (const Block& blk : blocks) {
-          // helper lambda
-          auto move_down = [&](){
-            cursor_y += CELL_HEIGHT;
-            insert_cell_pos += CELLS_PER_WIDTH;
-            assert(insert_line_pos >= 0 && insert_line_pos <= lines.size());
-            if (insert_cell_pos >= lines[insert_line_pos].size()) {
-              insert_line_pos += 1;
-              if (lines.size() == insert_line_pos) {
-                lines.emplace_back();
-              }
-              if (CELLS_PER_WIDTH == 0) {
-                insert_cell_pos = 0;
-              } else {
-                insert_cell_pos = insert_cell_pos - (insert_cell_pos / CELLS_PER_WIDTH) * CELLS_PER_WIDTH;
-              }
-            }
-          };
-
-          if (const UTF8Block* utf8_block = std::get_if<UTF8Block>(&blk)) {
-            if (utf8_block->data[0] == '\n') {
-              move_down();
-            } else if (utf8_block->data[0] == '\a') {
-              // no beep implemented
-            } else if (utf8_block->data[0] == '\b') {
-              cursor_x -= CELL_WIDTH;
-              if (cursor_x < 0) {
-                cursor_x = CELL_WIDTH * (CELLS_PER_WIDTH - 1);
-                cursor_y -= CELL_HEIGHT;
-                if (cursor_y < 0) {
-                  cursor_x = 0;
-                  cursor_y = 0;
-                }
-              }
-              insert_cell_pos -= 1;
-              if (insert_cell_pos < 0) {
-                insert_line_pos -= 1;
-                if (insert_line_pos < 0) {
-                  insert_cell_pos = 0;
-                  insert_line_pos = 0;
-                }
-              }
-            } else if (utf8_block->data[0] == '\r') {
-              cursor_x = 0;
-              insert_cell_pos = (insert_cell_pos / CELLS_PER_WIDTH) * CELLS_PER_WIDTH;
-            } else if (utf8_block->data[0] == '\t') {
-              insert_cell({character_manager.get(UTF8Block::space(), renderer), cursor_attributes});
-              while ((cursor_x / CELL_WIDTH) % 8 != 0) {
-                insert_cell({character_manager.get(UTF8Block::space(), renderer), cursor_attributes});
-              }
-            } else if (utf8_block->data[0] == '\0') {
-              // ignore
-            } else {
-              insert_cell({character_manager.get(*utf8_block, renderer), cursor_attributes});
-            }
-          } else if (const ANSICursorDown* cursor_down = std::get_if<ANSICursorDown>(&blk)) {
-            for (decltype(cursor_down->n) i = 0; i < cursor_down->n; ++i) {
-              move_down();
-            }
-          } else if (const ANSIGraphicsForeground* graphics_foreground_block = std::get_if<ANSIGraphicsForeground>(&blk)) {
-            cursor_attributes.fg = graphics_foreground_block->c;
-          } else if (const ANSIGraphicsBackground* graphics_background_block = std::get_if<ANSIGraphicsBackground>(&blk)) {
-            cursor_attributes.bg = graphics_background_block->c;
-          } else if (const ANSIEraseDisplay* erase_display_block = std::get_if<ANSIEraseDisplay>(&blk)) {
-            if (erase_display_block->type == 2) { // entire screen
-              SDL_RenderClear(renderer.get());
-              cursor_attributes = CellAttributes();
-              cursor_x = 0;
-              cursor_y = 0;
-              start_cell = 0;
-              start_line = 0;
-              insert_cell_pos = 0;
-              insert_line_pos = 0;
-              lines.clear();
-              lines.emplace_back();
-            } else {
-              // TODO part of screen
-            }
-          } else if (const ANSIGraphicsReset* reset_graphics_block = std::get_if<ANSIGraphicsReset>(&blk)) {
-            cursor_attributes = CellAttributes();
-          } else {
-            // TODO
-          }
+        full_redraw_required = false;
+
+        if (present_required) {
+          // blocks until the display refreshes (vsync), which is at most once per frame
+          SDL_SetRenderTarget(renderer.get(), NULL);
+          SDL_RenderCopy(renderer.get(), view_texture.get(), NULL, NULL);
+          SDL_RenderPresent(renderer.get());
+          present_required = false;
         }
-        SDL_RenderPresent(renderer.get());
+        frame_scheduler.presented(now);
+        // none of the rows in between were ever visible, so draw less often
+        frame_scheduler.set_flooding(rows_scrolled >= CELLS_PER_HEIGHT);
+        rows_scrolled = 0;
       }
-
-      // everything in the while loop is non blocking. don't consume entire core
-      std::this_thread::sleep_for(std::chrono::milliseconds(20));
     }
 break_topmost:
+    character_manager.save_glyph_cache();
     return true;
   }
 };
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+
+// a fixed size queue of bytes, written by one thread and read by another. lock free.
+// each side is given a contiguous region to write into or read from in place, so there
+// are no copies in or out
+class SPSCByteRing {
+  size_t capacity; // a power of 2
+  std::unique_ptr<char[]> buffer;
+  // both only ever increase. the position in the buffer is the value mod capacity
+  alignas(64) std::atomic<size_t> head{0}; // bytes written. only stored by the producer
+  alignas(64) std::atomic<size_t> tail{0}; // bytes read. only stored by the consumer
+
+ public:
+  struct Region {
+    char* data;
+    size_t size;
+  };
+
+  // capacity is rounded up to a power of 2
+  SPSCByteRing(size_t min_capacity) : capacity(1) {
+    while (capacity < min_capacity) {
+      capacity *= 2;
+    }
+    buffer.reset(new char[capacity]);
+  }
+
+  size_t get_capacity() const { return capacity; }
+
+  // bytes written but not yet read. only a snapshot when called from the other side
+  size_t size() const { return head.load() - tail.load(); }
+
+  // ================ producer
+
+  // where the next bytes can be written. empty if full. the rest of the free space
+  // (if it wraps around) is available after commit_write
+  Region write_region() const {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t free = capacity - (h - tail.load());
+    size_t offset = h & (capacity - 1);
+    return Region{buffer.get() + offset, std::min(free, capacity - offset)};
+  }
+
+  // n bytes of the write region were written and can be read
+  void commit_write(size_t n) { head.store(head.load(std::memory_order_relaxed) + n); }
+
+  // copies in as much as fits. returns how much that was
+  size_t push(const char* data, size_t length) {
+    size_t pushed = 0;
+    for (int i = 0; i < 2 && pushed < length; ++i) { // the free space is at most 2 regions
+      Region region = write_region();
+      size_t n = std::min(region.size, length - pushed);
+      memcpy(region.data, data + pushed, n);
+      commit_write(n);
+      pushed += n;
+    }
+    return pushed;
+  }
+
+  // ================ consumer
+
+  // the next bytes to read. empty if there aren't any
+  Region read_region() const {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t used = head.load() - t;
+    size_t offset = t & (capacity - 1);
+    return Region{buffer.get() + offset, std::min(used, capacity - offset)};
+  }
+
+  // all the bytes to read, as 2 regions if they wrap around. returns the number of regions
+  size_t read_regions(Region (&regions)[2]) const {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t used = head.load() - t;
+    size_t offset = t & (capacity - 1);
+    size_t first = std::min(used, capacity - offset);
+    regions[0] = Region{buffer.get() + offset, first};
+    regions[1] = Region{buffer.get(), used - first};
+    return used == 0 ? 0 : used == first ? 1 : 2;
+  }
+
+  // n bytes of the read region were read and can be written over
+  void commit_read(size_t n) { tail.store(tail.load(std::memory_order_relaxed) + n); }
+};
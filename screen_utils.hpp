@@ -0,0 +1,348 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "color.hpp"
+
+// the colors of a cell. these are stored once in an AttributeTable and referenced by cells
+struct CellAttributes {
+  Color fg{255, 255, 255};
+  Color bg;
+
+  bool operator==(const CellAttributes& other) const { return fg == other.fg && bg == other.bg; }
+};
+
+namespace std {
+template <>
+struct hash<CellAttributes> {
+  size_t operator()(const CellAttributes& a) const {
+    uint64_t packed = (uint64_t)a.fg.r << 40 | (uint64_t)a.fg.g << 32 | (uint64_t)a.fg.b << 24 | //
+                      (uint64_t)a.bg.r << 16 | (uint64_t)a.bg.g << 8 | (uint64_t)a.bg.b;
+    return std::hash<uint64_t>{}(packed);
+  }
+};
+} // namespace std
+
+// deduplicates CellAttributes, so each cell only stores a 16 bit id.
+// a screen only uses a few dozen distinct attributes at a time, but over a long
+// session (e.g. rgb gradients) far more than 2^16 can be created. when the table
+// fills up it's compacted: the owner marks every id that is still referenced by a
+// cell and the rest are reused. marks are per epoch, so there's nothing to reset
+class AttributeTable {
+  std::vector<CellAttributes> attributes; // indexed by id
+  std::vector<uint32_t> marked_epoch;     // indexed by id. id is live if it equals epoch
+  std::unordered_map<CellAttributes, uint16_t> ids;
+  std::vector<uint16_t> free_ids;
+  uint32_t epoch = 0;
+
+ public:
+  static constexpr size_t MAX_ENTRIES = 1 << 16;
+
+  // the default attributes always have this id, and are never collected
+  static constexpr uint16_t DEFAULT_ID = 0;
+
+  AttributeTable() {
+    attributes.push_back(CellAttributes());
+    marked_epoch.push_back(0);
+    ids.emplace(CellAttributes(), DEFAULT_ID);
+  }
+
+  size_t size() const { return ids.size(); }
+
+  // returns the id for the attributes, adding them if needed. if the table is
+  // full, it's compacted first. for_each_live_id(mark) must call mark(id) for
+  // every id that is referenced anywhere
+  template <typename F>
+  uint16_t intern(const CellAttributes& a, F&& for_each_live_id) {
+    auto it = ids.find(a);
+    if (it != ids.end()) {
+      return it->second;
+    }
+
+    if (free_ids.empty() && attributes.size() == MAX_ENTRIES) {
+      compact(for_each_live_id);
+      if (free_ids.empty()) {
+        return DEFAULT_ID; // every id is in use. extremely unlikely
+      }
+    }
+
+    uint16_t id;
+    if (!free_ids.empty()) {
+      id = free_ids.back();
+      free_ids.pop_back();
+      attributes[id] = a;
+    } else {
+      id = attributes.size();
+      attributes.push_back(a);
+      marked_epoch.push_back(epoch);
+    }
+    ids.emplace(a, id);
+    return id;
+  }
+
+  // frees every id that isn't marked by for_each_live_id (see intern).
+  // ids that are reused map to different attributes, so any cached ids must be discarded after
+  template <typename F>
+  void compact(F&& for_each_live_id) {
+    ++epoch;
+    marked_epoch[DEFAULT_ID] = epoch;
+    for_each_live_id([&](uint16_t id) {
+      assert(id < marked_epoch.size());
+      marked_epoch[id] = epoch;
+    });
+
+    free_ids.clear();
+    for (size_t id = 0; id < attributes.size(); ++id) {
+      if (marked_epoch[id] != epoch) {
+        ids.erase(attributes[id]);
+        free_ids.push_back(id);
+      }
+    }
+  }
+
+  const CellAttributes& operator[](uint16_t id) const {
+    assert(id < attributes.size());
+    return attributes[id];
+  }
+};
+
+// bits for Cell::flags
+static constexpr uint32_t CELL_BOLD = 1 << 0;
+static constexpr uint32_t CELL_ITALIC = 1 << 1;
+static constexpr uint32_t CELL_UNDERLINE = 1 << 2;
+
+// a single character in the grid, packed into 8 bytes. the glyph is looked up
+// from the code point when the cell is drawn
+struct Cell {
+  uint32_t code_point : 21; // all of unicode fits in 21 bits
+  uint32_t flags : 11;
+  uint16_t attributes; // id in an AttributeTable
+
+  static Cell blank(uint16_t attributes = AttributeTable::DEFAULT_ID) { return Cell{' ', 0, attributes}; }
+
+  // a space with default attributes. this is what the screen is filled with
+  bool is_blank() const { return code_point == ' ' && flags == 0 && attributes == AttributeTable::DEFAULT_ID; }
+};
+
+static_assert(sizeof(Cell) == 8, "cells are packed");
+
+// a line of cells, pointing into storage owned by something else
+struct LineView {
+  const Cell* data;
+  size_t size;
+};
+
+// the number of rows a line takes up on a screen of the given width
+size_t visual_rows(size_t line_length, unsigned int width) {
+  return line_length == 0 ? 1 : (line_length + width - 1) / width;
+}
+
+// the visible grid of cells. the rows are kept in a ring, so scrolling moves the
+// index of the top row rather than the cells themselves. rows that scroll off the
+// top are given to a callback (e.g. to be put in the Scrollback).
+//
+// each row that changes is marked damaged, so only those rows need to be redrawn
+class Screen {
+  unsigned int width;
+  unsigned int height;
+  std::vector<Cell> cells;    // height rows of width cells
+  std::vector<bool> wrapping; // by physical row. the row continues on the next one
+  std::vector<bool> damaged;  // by row (not physical row, since what's drawn at a row moves when scrolled)
+  unsigned int top = 0;       // physical row of the top row on the screen
+
+  unsigned int physical_row(unsigned int row) const {
+    assert(row < height);
+    unsigned int ret = top + row;
+    return ret >= height ? ret - height : ret;
+  }
+
+ public:
+  struct Cursor {
+    unsigned int row = 0;
+    unsigned int col = 0;
+    // the last column was written. the next character goes at the start of the next row.
+    // this lets a full width line be followed by a newline without a blank line in between
+    bool pending_wrap = false;
+  };
+
+  Cursor cursor;
+  Cursor saved_cursor; // ESC 7, CSI s
+  // saved along with the cursor position. each screen has its own
+  CellAttributes saved_attributes;
+  uint32_t saved_flags = 0;
+
+  Screen(unsigned int width, unsigned int height) : width(width), height(height), cells(width * height, Cell::blank()), wrapping(height, false), damaged(height, true) {
+    assert(width != 0 && height != 0);
+  }
+
+  unsigned int get_width() const { return width; }
+  unsigned int get_height() const { return height; }
+
+  Cell* row(unsigned int r) { return &cells[physical_row(r) * width]; }
+  const Cell* row(unsigned int r) const { return &cells[physical_row(r) * width]; }
+
+  // the row continues on the next one (the text was wrapped rather than broken by a newline)
+  bool row_wraps(unsigned int r) const { return wrapping[physical_row(r)]; }
+
+  // the row has changed since the damage was last cleared
+  bool is_damaged(unsigned int r) const { return damaged[r]; }
+  bool any_damaged() const { return std::find(damaged.begin(), damaged.end(), true) != damaged.end(); }
+  void damage(unsigned int r) { damaged[r] = true; }
+  void damage_all() { damaged.assign(height, true); }
+  void clear_damage() { damaged.assign(height, false); }
+
+  // moves the top n rows off the screen. blank rows enter from the bottom. O(n rows)
+  template <typename F>
+  void scroll_up(unsigned int n, Cell fill, F&& on_scroll_off) {
+    n = std::min(n, height);
+    for (unsigned int i = 0; i < n; ++i) {
+      Cell* r = row(0);
+      on_scroll_off(static_cast<const Cell*>(r), width, (bool)wrapping[top]);
+      std::fill(r, r + width, fill);
+      wrapping[top] = false;
+      // the old top row is now the bottom row
+      top = top + 1 == height ? 0 : top + 1;
+    }
+    if (n != 0) {
+      damage_all();
+    }
+  }
+
+  // moves the bottom n rows off the screen (they are discarded). blank rows enter from the top
+  void scroll_down(unsigned int n, Cell fill) {
+    n = std::min(n, height);
+    for (unsigned int i = 0; i < n; ++i) {
+      top = top == 0 ? height - 1 : top - 1;
+      Cell* r = row(0);
+      std::fill(r, r + width, fill);
+      wrapping[top] = false;
+    }
+    // the new bottom row used to wrap onto a row that's now gone
+    wrapping[physical_row(height - 1)] = false;
+    if (n != 0) {
+      damage_all();
+    }
+  }
+
+  template <typename F>
+  void line_feed(Cell fill, F&& on_scroll_off) {
+    cursor.pending_wrap = false;
+    if (cursor.row + 1 == height) {
+      scroll_up(1, fill, on_scroll_off);
+    } else {
+      cursor.row += 1;
+    }
+  }
+
+  void carriage_return() {
+    cursor.col = 0;
+    cursor.pending_wrap = false;
+  }
+
+  void backspace() {
+    if (cursor.col > 0) {
+      cursor.col -= 1;
+    }
+    cursor.pending_wrap = false;
+  }
+
+  void tab() {
+    cursor.col = std::min(width - 1, (cursor.col / 8 + 1) * 8);
+    cursor.pending_wrap = false;
+  }
+
+  // writes the cell at the cursor and moves the cursor forward
+  template <typename F>
+  void put(Cell cell, Cell fill, F&& on_scroll_off) {
+    if (cursor.pending_wrap) {
+      wrapping[physical_row(cursor.row)] = true;
+      line_feed(fill, on_scroll_off);
+      cursor.col = 0;
+    }
+    row(cursor.row)[cursor.col] = cell;
+    damaged[cursor.row] = true;
+    if (cursor.col + 1 == width) {
+      cursor.pending_wrap = true;
+    } else {
+      cursor.col += 1;
+    }
+  }
+
+  // writes as much of the ascii as fits on the cursor's row in one pass, and moves the cursor forward.
+  // returns the number of bytes written. call again with the rest to continue on the next row
+  template <typename F>
+  size_t put_ascii(const char* data, size_t length, uint32_t flags, uint16_t attributes, Cell fill, F&& on_scroll_off) {
+    if (cursor.pending_wrap) {
+      wrapping[physical_row(cursor.row)] = true;
+      line_feed(fill, on_scroll_off);
+      cursor.col = 0;
+    }
+    size_t n = std::min<size_t>(length, width - cursor.col);
+    Cell* out = row(cursor.row) + cursor.col;
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = Cell{(unsigned char)data[i], flags, attributes};
+    }
+    damaged[cursor.row] = true;
+    cursor.col += n;
+    if (cursor.col == width) {
+      cursor.col = width - 1;
+      cursor.pending_wrap = true;
+    }
+    return n;
+  }
+
+  // moves the cursor, clamped to the screen. 0 based
+  void move_cursor(int row, int col) {
+    cursor.row = std::clamp(row, 0, (int)height - 1);
+    cursor.col = std::clamp(col, 0, (int)width - 1);
+    cursor.pending_wrap = false;
+  }
+
+  // 0: cursor to end of line, 1: start of line to cursor, 2: whole line. O(row)
+  void erase_line(unsigned char type, Cell fill) {
+    Cell* r = row(cursor.row);
+    damaged[cursor.row] = true;
+    if (type == 0) {
+      std::fill(r + cursor.col, r + width, fill);
+      wrapping[physical_row(cursor.row)] = false;
+    } else if (type == 1) {
+      std::fill(r, r + cursor.col + 1, fill);
+    } else if (type == 2) {
+      std::fill(r, r + width, fill);
+      wrapping[physical_row(cursor.row)] = false;
+    }
+  }
+
+  // 0: cursor to end of screen, 1: start of screen to cursor, 2: whole screen
+  void erase_display(unsigned char type, Cell fill) {
+    unsigned int first_row = 0;
+    unsigned int last_row = height; // exclusive
+    if (type == 0) {
+      erase_line(0, fill);
+      first_row = cursor.row + 1;
+    } else if (type == 1) {
+      erase_line(1, fill);
+      last_row = cursor.row;
+    } else if (type != 2) {
+      return;
+    }
+    for (unsigned int r = first_row; r < last_row; ++r) {
+      std::fill(row(r), row(r) + width, fill);
+      wrapping[physical_row(r)] = false;
+      damaged[r] = true;
+    }
+  }
+
+  // calls f with each cell. used for attribute compaction
+  template <typename F>
+  void for_each_cell(F&& f) const {
+    for (const Cell& cell : cells) {
+      f(cell);
+    }
+  }
+};
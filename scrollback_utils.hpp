@@ -0,0 +1,695 @@
+#pragma once
+
+#include <errno.h>
+#include <lz4.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "file_utils.hpp"
+#include "screen_utils.hpp"
+#include "string_utils.hpp"
+
+// sums of a sequence of counts (a fenwick tree). appending, changing a count, finding
+// the sum of a prefix, and finding which element a running total falls in are O(log n)
+class PrefixSums {
+  std::vector<uint64_t> tree; // 1 based. tree[i] is the sum of the lowbit(i) counts ending at i
+
+  static size_t lowbit(size_t i) { return i & -i; }
+
+ public:
+  PrefixSums() : tree(1) {}
+
+  size_t size() const { return tree.size() - 1; }
+
+  // the sum of the first n counts
+  uint64_t sum(size_t n) const {
+    uint64_t ret = 0;
+    for (; n != 0; n -= lowbit(n)) {
+      ret += tree[n];
+    }
+    return ret;
+  }
+
+  uint64_t get(size_t index) const { return sum(index + 1) - sum(index); }
+
+  void push_back(uint64_t count) {
+    size_t i = tree.size();
+    tree.push_back(count + sum(i - 1) - sum(i - lowbit(i)));
+  }
+
+  void add(size_t index, int64_t delta) {
+    for (size_t i = index + 1; i < tree.size(); i += lowbit(i)) {
+      tree[i] += delta;
+    }
+  }
+
+  // the index of the count that contains the running total, which is reduced to an
+  // offset within that count. total must be less than sum(size())
+  size_t find(uint64_t& total) const {
+    size_t index = 0;
+    size_t step = 1;
+    while (step * 2 < tree.size()) {
+      step *= 2;
+    }
+    for (; step != 0; step /= 2) {
+      if (index + step < tree.size() && tree[index + step] <= total) {
+        index += step;
+        total -= tree[index];
+      }
+    }
+    return index;
+  }
+
+  // removes the first n counts. O(size())
+  void erase_front(size_t n) {
+    std::vector<uint64_t> counts;
+    for (size_t i = n; i < size(); ++i) {
+      counts.push_back(get(i));
+    }
+    tree.assign(1, 0);
+    tree.insert(tree.end(), counts.begin(), counts.end());
+    for (size_t i = 1; i < tree.size(); ++i) {
+      size_t parent = i + lowbit(i);
+      if (parent < tree.size()) {
+        tree[parent] += tree[i];
+      }
+    }
+  }
+};
+
+// an append only file which is memory mapped for reading. it's unlinked as soon as
+// it's created, so it's deleted on exit no matter how that happens.
+// data is dropped from the front. its space is given back by punching a hole, so the
+// storage used stays bounded (the file's size keeps growing, but the hole takes no space)
+class SpillFile {
+  FileDescriptor fd;
+  size_t size = 0;      // bytes appended
+  size_t discarded = 0; // bytes before this aren't needed
+  mutable const char* mapping = NULL;
+  mutable size_t mapped_size = 0;
+
+  SpillFile(FileDescriptor fd) : fd(std::move(fd)) {}
+
+  void unmap() const {
+    if (mapping != NULL && munmap((void*)mapping, mapped_size) == -1) {
+      perror("err munmap spill file");
+    }
+    mapping = NULL;
+    mapped_size = 0;
+  }
+
+ public:
+  // empty for failure: error reason printed.
+  // the file is placed in $XDG_RUNTIME_DIR, or /tmp if that isn't set
+  static std::optional<SpillFile> create() {
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    if (dir == NULL || *dir == '\0') {
+      dir = "/tmp";
+    }
+    std::string path = std::string(dir) + "/terminal-scrollback-XXXXXX";
+    FileDescriptor fd(mkstemp(path.data()));
+    if (!fd) {
+      fprintf(stderr, "err create %s: %s\n", path.c_str(), strerror(errno));
+      return {};
+    }
+    if (unlink(path.c_str()) == -1) {
+      fprintf(stderr, "err unlink %s: %s\n", path.c_str(), strerror(errno));
+      return {};
+    }
+    return SpillFile(std::move(fd));
+  }
+
+  SpillFile(const SpillFile&) = delete;
+  SpillFile& operator=(const SpillFile&) = delete;
+  SpillFile& operator=(SpillFile&&) = delete;
+
+  SpillFile(SpillFile&& other) noexcept
+      : fd(std::move(other.fd)), size(other.size), discarded(other.discarded), mapping(other.mapping), mapped_size(other.mapped_size) {
+    other.mapping = NULL;
+    other.mapped_size = 0;
+  }
+
+  ~SpillFile() { unmap(); }
+
+  // returns the offset the data was written at. empty for failure (error printed)
+  std::optional<uint64_t> append(const void* data, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+      ssize_t ret = pwrite(fd, (const char*)data + written, length - written, size + written);
+      if (ret == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("err write spill file");
+        return {}; // a partial write is overwritten by the next append
+      }
+      written += ret;
+    }
+    uint64_t offset = size;
+    size += length;
+    return offset;
+  }
+
+  // everything before offset is no longer needed
+  void discard_before(uint64_t offset) {
+    if (offset <= discarded) {
+      return;
+    }
+    // from the start of the page, since a page partly covered by a hole isn't freed.
+    // the part of it before discarded was already given back
+    static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t begin = discarded / page_size * page_size;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, begin, offset - begin) == -1) {
+      perror("err punch hole in spill file");
+    }
+    discarded = offset;
+  }
+
+  // bytes of storage the file takes up
+  size_t allocated_size() const {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      perror("err stat spill file");
+      return 0;
+    }
+    return (size_t)st.st_blocks * 512;
+  }
+
+  // a pointer to previously appended bytes. valid until the next call.
+  // NULL for failure (error printed)
+  const char* at(uint64_t offset, size_t length) const {
+    assert(offset + length <= size);
+    if (offset + length > mapped_size) {
+      // the file has grown since it was mapped
+      unmap();
+      void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+        perror("err mmap spill file");
+        return NULL;
+      }
+      mapping = (const char*)p;
+      mapped_size = size;
+    }
+    return mapping + offset;
+  }
+};
+
+// rows that scroll off the top of the screen. rows that were joined by wrapping are
+// stored together as one logical line, without trailing blanks.
+//
+// lines are kept in chunks of a fixed number of lines, with each chunk's cells stored
+// contiguously. lines are addressed by an absolute number which counts every line
+// ever pushed, so a line number stays valid (refers to the same line) after older
+// lines are evicted. once the limits are exceeded the oldest chunk is dropped whole.
+//
+// chunks that are far enough above the screen are rarely looked at, so they are
+// made cold: the cells are packed as utf8 text plus runs of attributes, and then
+// compressed with lz4. a cold chunk is decompressed when one of its lines is looked
+// at (e.g. when the view is scrolled back to it), and a few are kept decompressed.
+//
+// once the memory limit is reached, the oldest chunks are spilled to a SpillFile instead
+// of being evicted. only a small index entry stays in memory for each spilled chunk, so
+// any spilled line can still be found in O(1).
+//
+// lines are wrapped at a fixed width when drawn. the number of visual rows in each chunk
+// is kept in PrefixSums, so a visual row can be mapped to a line (and back) in O(log n)
+class Scrollback {
+ public:
+  static constexpr size_t LINES_PER_CHUNK = 256;
+
+  // a visual row: the line, and the index of the first cell in the row
+  struct Position {
+    size_t line;
+    size_t cell;
+  };
+
+  struct Limits {
+    size_t max_lines;
+    size_t max_bytes;
+    size_t hot_lines; // the newest lines which are never compressed
+    bool spill;       // past max_bytes, the oldest lines are moved to a file instead of evicted
+  };
+
+ private:
+  // the attributes of consecutive cells, in the packed form of a cold chunk
+  struct AttributeSpan {
+    uint32_t length;
+    uint16_t flags;
+    uint16_t attributes;
+  };
+
+  struct Chunk {
+    std::vector<Cell> cells;        // when hot
+    std::vector<char> compressed;   // when cold
+    size_t uncompressed_size = 0;   // when cold
+    std::vector<uint16_t> attribute_ids; // when cold: each attribute id referenced, for compaction
+    uint32_t line_ends[LINES_PER_CHUNK]; // by line in the chunk: offset in cells one past the end of the line
+    size_t line_count = 0;
+
+    bool cold() const { return !compressed.empty(); }
+    size_t cell_count() const { return line_count == 0 ? 0 : line_ends[line_count - 1]; }
+
+    size_t memory_usage() const {
+      return sizeof(Chunk) + cells.capacity() * sizeof(Cell) + compressed.capacity() + attribute_ids.capacity() * sizeof(uint16_t);
+    }
+  };
+
+  // a cold chunk that was moved to the spill file. in the file: its line_ends, then its compressed cells
+  struct SpilledChunk {
+    uint64_t offset;
+    uint32_t line_count;
+    uint32_t compressed_size;
+    uint32_t uncompressed_size;
+  };
+
+  // decompressed cold or spilled chunks, by chunk number (absolute line / LINES_PER_CHUNK).
+  // a line view into one is valid until a different cold chunk is looked at
+  struct DecompressedChunk {
+    size_t chunk_number = SIZE_MAX;
+    std::vector<Cell> cells;
+    uint64_t last_used = 0;
+  };
+  static constexpr size_t DECOMPRESSED_CHUNKS = 4;
+  mutable DecompressedChunk decompressed[DECOMPRESSED_CHUNKS];
+  mutable uint64_t decompressed_clock = 0;
+
+  Limits limits;
+  unsigned int wrap_width;
+  // visual rows by chunk, starting at chunk number chunk_rows_base. evicted chunks count 0 rows
+  PrefixSums chunk_rows;
+  size_t chunk_rows_base = 0;
+  std::deque<SpilledChunk> spilled; // the oldest lines. these come before chunks
+  std::deque<std::unique_ptr<Chunk>> chunks;
+  std::optional<SpillFile> spill_file; // created the first time it's needed
+  bool spill_failed = false;
+  // every attribute id referenced by a spilled chunk, for compaction. ids are never
+  // unmarked, since that would require reading the file
+  std::vector<bool> spilled_attribute_ids = std::vector<bool>(AttributeTable::MAX_ENTRIES);
+  size_t first_line = 0;  // absolute number of the oldest line. always a multiple of LINES_PER_CHUNK
+  size_t line_count = 0;  // lines held, including spilled lines
+  size_t used_bytes = 0;  // memory used by all chunks, except the cells of the last chunk
+  bool last_line_continues = false; // the last row pushed wrapped onto the next one
+
+  // packs and compresses a full chunk. it's left hot if compression fails (error printed)
+  static void make_cold(Chunk& chunk) {
+    std::vector<char> packed;
+    size_t text_size = 0;
+    std::vector<AttributeSpan> spans;
+    packed.resize(sizeof(text_size)); // filled in after
+    for (const Cell& cell : chunk.cells) {
+      char utf8_char[MAX_BYTES_PER_CHARACTER + 1];
+      size_t length = encode_utf8(cell.code_point, utf8_char);
+      packed.insert(packed.end(), utf8_char, utf8_char + length);
+      text_size += length;
+      if (!spans.empty() && spans.back().flags == cell.flags && spans.back().attributes == cell.attributes) {
+        spans.back().length += 1;
+      } else {
+        spans.push_back(AttributeSpan{1, (uint16_t)cell.flags, cell.attributes});
+      }
+    }
+    memcpy(packed.data(), &text_size, sizeof(text_size));
+    const char* spans_begin = reinterpret_cast<const char*>(spans.data());
+    packed.insert(packed.end(), spans_begin, spans_begin + spans.size() * sizeof(AttributeSpan));
+
+    std::vector<char> compressed(LZ4_compressBound(packed.size()));
+    int compressed_size = LZ4_compress_default(packed.data(), compressed.data(), packed.size(), compressed.size());
+    if (compressed_size <= 0) {
+      fputs("err lz4 compress scrollback\n", stderr);
+      return;
+    }
+    compressed.resize(compressed_size);
+    compressed.shrink_to_fit();
+
+    std::vector<uint16_t> attribute_ids;
+    for (const AttributeSpan& span : spans) {
+      attribute_ids.push_back(span.attributes);
+    }
+    std::sort(attribute_ids.begin(), attribute_ids.end());
+    attribute_ids.erase(std::unique(attribute_ids.begin(), attribute_ids.end()), attribute_ids.end());
+    attribute_ids.shrink_to_fit();
+
+    chunk.compressed = std::move(compressed);
+    chunk.uncompressed_size = packed.size();
+    chunk.attribute_ids = std::move(attribute_ids);
+    chunk.cells = std::vector<Cell>();
+  }
+
+  // the reverse of make_cold. blanks on failure (error printed)
+  static void unpack(const char* compressed, size_t compressed_size, size_t uncompressed_size, size_t cell_count,
+                     std::vector<Cell>& out) {
+    out.assign(cell_count, Cell::blank());
+    if (compressed == NULL) {
+      return;
+    }
+    std::vector<char> packed(uncompressed_size);
+    int size = LZ4_decompress_safe(compressed, packed.data(), compressed_size, packed.size());
+    if (size != (int)packed.size()) {
+      fputs("err lz4 decompress scrollback\n", stderr);
+      return;
+    }
+
+    size_t text_size;
+    memcpy(&text_size, packed.data(), sizeof(text_size));
+    const unsigned char* text = reinterpret_cast<const unsigned char*>(packed.data()) + sizeof(text_size);
+    const char* spans_begin = packed.data() + sizeof(text_size) + text_size;
+    size_t span_count = (packed.size() - sizeof(text_size) - text_size) / sizeof(AttributeSpan);
+
+    size_t cell_index = 0;
+    for (size_t i = 0; i < span_count; ++i) {
+      AttributeSpan span;
+      memcpy(&span, spans_begin + i * sizeof(AttributeSpan), sizeof(span));
+      for (uint32_t j = 0; j < span.length && cell_index < out.size(); ++j) {
+        // the text was encoded by make_cold, so it's known to be valid
+        char32_t cp = *text++;
+        if (cp >= 0xF0) {
+          cp = (cp & 0b111) << 18 | (text[0] & 0b111111) << 12 | (text[1] & 0b111111) << 6 | (text[2] & 0b111111);
+          text += 3;
+        } else if (cp >= 0xE0) {
+          cp = (cp & 0b1111) << 12 | (text[0] & 0b111111) << 6 | (text[1] & 0b111111);
+          text += 2;
+        } else if (cp >= 0x80) {
+          cp = (cp & 0b11111) << 6 | (text[0] & 0b111111);
+          text += 1;
+        }
+        out[cell_index++] = Cell{cp, span.flags, span.attributes};
+      }
+    }
+  }
+
+  // the cells of a cold chunk, decompressing them with unpack_into(cells) if they aren't already
+  template <typename F>
+  const Cell* decompressed_cells(size_t chunk_number, F&& unpack_into) const {
+    DecompressedChunk* slot = &decompressed[0];
+    for (DecompressedChunk& d : decompressed) {
+      if (d.chunk_number == chunk_number) {
+        slot = &d;
+        break;
+      }
+      if (d.last_used < slot->last_used) {
+        slot = &d; // least recently used
+      }
+    }
+    if (slot->chunk_number != chunk_number) {
+      unpack_into(slot->cells);
+      slot->chunk_number = chunk_number;
+    }
+    slot->last_used = ++decompressed_clock;
+    return slot->cells.data();
+  }
+
+  const Cell* cells_of(const Chunk& chunk, size_t chunk_number) const {
+    if (!chunk.cold()) {
+      return chunk.cells.data();
+    }
+    return decompressed_cells(chunk_number, [&](std::vector<Cell>& out) {
+      unpack(chunk.compressed.data(), chunk.compressed.size(), chunk.uncompressed_size, chunk.cell_count(), out);
+    });
+  }
+
+  // by line in the chunk: offset in cells one past the end of the line. 0 on failure (error printed)
+  uint32_t spilled_line_end(const SpilledChunk& chunk, size_t index) const {
+    const char* p = spill_file->at(chunk.offset + index * sizeof(uint32_t), sizeof(uint32_t));
+    if (p == NULL) {
+      return 0;
+    }
+    uint32_t end;
+    memcpy(&end, p, sizeof(end)); // might be unaligned
+    return end;
+  }
+
+  const Cell* cells_of(const SpilledChunk& chunk, size_t chunk_number) const {
+    return decompressed_cells(chunk_number, [&](std::vector<Cell>& out) {
+      size_t cell_count = spilled_line_end(chunk, chunk.line_count - 1);
+      uint64_t offset = chunk.offset + chunk.line_count * sizeof(uint32_t);
+      unpack(spill_file->at(offset, chunk.compressed_size), chunk.compressed_size, chunk.uncompressed_size, cell_count, out);
+    });
+  }
+
+  // moves a chunk to the spill file. false on failure (error printed), and the chunk is kept
+  bool spill(Chunk& chunk) {
+    if (!limits.spill || spill_failed) {
+      return false;
+    }
+    if (!spill_file) {
+      std::optional<SpillFile> created = SpillFile::create();
+      if (!created) {
+        spill_failed = true;
+        return false;
+      }
+      spill_file.emplace(std::move(*created));
+    }
+    if (!chunk.cold()) {
+      make_cold(chunk);
+      if (!chunk.cold()) {
+        return false;
+      }
+    }
+    std::optional<uint64_t> offset = spill_file->append(chunk.line_ends, chunk.line_count * sizeof(uint32_t));
+    if (!offset || !spill_file->append(chunk.compressed.data(), chunk.compressed.size())) {
+      return false;
+    }
+    spilled.push_back(SpilledChunk{*offset, (uint32_t)chunk.line_count, (uint32_t)chunk.compressed.size(),
+                                   (uint32_t)chunk.uncompressed_size});
+    for (uint16_t id : chunk.attribute_ids) {
+      spilled_attribute_ids[id] = true;
+    }
+    return true;
+  }
+
+  void drop_oldest() {
+    size_t dropped_lines;
+    if (!spilled.empty()) {
+      const SpilledChunk& oldest = spilled.front();
+      dropped_lines = oldest.line_count;
+      spill_file->discard_before(oldest.offset + oldest.line_count * sizeof(uint32_t) + oldest.compressed_size);
+      spilled.pop_front();
+    } else {
+      const Chunk& oldest = *chunks.front();
+      used_bytes -= oldest.memory_usage();
+      dropped_lines = oldest.line_count;
+      chunks.pop_front();
+    }
+    chunk_rows.add(first_line / LINES_PER_CHUNK - chunk_rows_base, -(int64_t)chunk_rows.get(first_line / LINES_PER_CHUNK - chunk_rows_base));
+    line_count -= dropped_lines;
+    first_line += dropped_lines;
+
+    size_t evicted_chunks = first_line / LINES_PER_CHUNK - chunk_rows_base;
+    if (evicted_chunks > chunk_rows.size() / 2) {
+      // amortized O(1)
+      chunk_rows.erase_front(evicted_chunks);
+      chunk_rows_base += evicted_chunks;
+    }
+  }
+
+  // visual rows of the lines in [begin, end), which are in the same chunk. O(LINES_PER_CHUNK)
+  size_t rows_in_lines(size_t begin, size_t end) const {
+    size_t rows = 0;
+    for (size_t line = begin; line < end; ++line) {
+      rows += visual_rows(line_length(line), wrap_width);
+    }
+    return rows;
+  }
+
+  void evict_if_needed() {
+    // the last chunk is being written to, so it's always kept
+    while (chunks.size() > 1 && memory_usage() > limits.max_bytes) {
+      Chunk& oldest = *chunks.front();
+      size_t oldest_bytes = oldest.memory_usage();
+      if (spill(oldest)) {
+        used_bytes -= oldest_bytes;
+        chunks.pop_front();
+      } else {
+        // lines can't be skipped, so everything older goes with it
+        while (!spilled.empty()) {
+          drop_oldest();
+        }
+        drop_oldest();
+      }
+    }
+    while (spilled.size() + chunks.size() > 1 && line_count > limits.max_lines) {
+      drop_oldest();
+    }
+  }
+
+ public:
+  // lines are wrapped at wrap_width cells when counting visual rows
+  Scrollback(Limits limits, unsigned int wrap_width) : limits(limits), wrap_width(wrap_width) {}
+
+  // absolute number of the oldest line held
+  size_t begin_line() const { return first_line; }
+  // absolute number one past the newest line
+  size_t end_line() const { return first_line + line_count; }
+
+  // bytes used by the cells and bookkeeping of the lines held in memory (not spilled)
+  size_t memory_usage() const {
+    return used_bytes + (chunks.empty() ? 0 : chunks.back()->cells.capacity() * sizeof(Cell));
+  }
+
+  // bytes of storage used by the spilled lines
+  size_t spill_file_usage() const { return spill_file ? spill_file->allocated_size() : 0; }
+
+  // by absolute line number. O(1), though a cold or spilled line is decompressed if it wasn't
+  // recently looked at. the view is valid until the scrollback is modified or a different
+  // cold line is looked at
+  LineView operator[](size_t line) const {
+    assert(line >= begin_line() && line < end_line());
+    size_t chunk_number = line / LINES_PER_CHUNK;
+    size_t chunk_index = chunk_number - first_line / LINES_PER_CHUNK;
+    size_t index = line % LINES_PER_CHUNK;
+    if (chunk_index < spilled.size()) {
+      const SpilledChunk& chunk = spilled[chunk_index];
+      size_t begin = index == 0 ? 0 : spilled_line_end(chunk, index - 1);
+      size_t end = spilled_line_end(chunk, index);
+      const Cell* cells = cells_of(chunk, chunk_number);
+      return end < begin ? LineView{cells, 0} : LineView{cells + begin, end - begin};
+    }
+    const Chunk& chunk = *chunks[chunk_index - spilled.size()];
+    size_t begin = index == 0 ? 0 : chunk.line_ends[index - 1];
+    return LineView{cells_of(chunk, chunk_number) + begin, chunk.line_ends[index] - begin};
+  }
+
+  // the number of cells in a line. O(1) and doesn't decompress anything
+  size_t line_length(size_t line) const {
+    assert(line >= begin_line() && line < end_line());
+    size_t chunk_index = line / LINES_PER_CHUNK - first_line / LINES_PER_CHUNK;
+    size_t index = line % LINES_PER_CHUNK;
+    if (chunk_index < spilled.size()) {
+      const SpilledChunk& chunk = spilled[chunk_index];
+      size_t begin = index == 0 ? 0 : spilled_line_end(chunk, index - 1);
+      size_t end = spilled_line_end(chunk, index);
+      return end < begin ? 0 : end - begin;
+    }
+    const Chunk& chunk = *chunks[chunk_index - spilled.size()];
+    size_t begin = index == 0 ? 0 : chunk.line_ends[index - 1];
+    return chunk.line_ends[index] - begin;
+  }
+
+  // the number of visual rows in all held lines
+  size_t row_count() const { return chunk_rows.sum(chunk_rows.size()); }
+
+  // the number of visual rows before a line, counting from begin_line(). O(log n)
+  size_t row_of(size_t line) const {
+    assert(line >= begin_line() && line <= end_line());
+    size_t chunk_begin = line / LINES_PER_CHUNK * LINES_PER_CHUNK;
+    return chunk_rows.sum(line / LINES_PER_CHUNK - chunk_rows_base) + rows_in_lines(chunk_begin, line);
+  }
+
+  // the reverse of row_of. row must be less than row_count(). O(log n)
+  Position position_of_row(size_t row) const {
+    assert(row < row_count());
+    uint64_t rows_into_chunk = row;
+    size_t line = (chunk_rows_base + chunk_rows.find(rows_into_chunk)) * LINES_PER_CHUNK;
+    while (1) {
+      size_t rows = visual_rows(line_length(line), wrap_width);
+      if (rows_into_chunk < rows) {
+        return Position{line, rows_into_chunk * wrap_width};
+      }
+      rows_into_chunk -= rows;
+      line += 1;
+    }
+  }
+
+  void push_row(const Cell* row, unsigned int width, bool wrapped) {
+    bool new_line = !last_line_continues || chunks.empty();
+    if (new_line) {
+      // start a new line
+      if (chunks.empty() || chunks.back()->line_count == LINES_PER_CHUNK) {
+        if (!chunks.empty()) {
+          // the last chunk is full and won't change
+          Chunk& sealed = *chunks.back();
+          sealed.cells.shrink_to_fit();
+          used_bytes += sealed.cells.capacity() * sizeof(Cell);
+
+          // and the chunk that's now far enough back goes cold
+          size_t hot_chunks = (limits.hot_lines + LINES_PER_CHUNK - 1) / LINES_PER_CHUNK;
+          if (chunks.size() > hot_chunks) {
+            Chunk& cooled = *chunks[chunks.size() - 1 - hot_chunks];
+            if (!cooled.cold()) {
+              used_bytes -= cooled.memory_usage();
+              make_cold(cooled);
+              used_bytes += cooled.memory_usage();
+            }
+          }
+        }
+        chunks.push_back(std::make_unique<Chunk>());
+        used_bytes += sizeof(Chunk);
+        chunk_rows.push_back(0);
+      }
+      Chunk& chunk = *chunks.back();
+      chunk.line_ends[chunk.line_count] = chunk.cells.size();
+      chunk.line_count += 1;
+      line_count += 1;
+    }
+
+    unsigned int length = width;
+    if (!wrapped) {
+      while (length > 0 && row[length - 1].is_blank()) {
+        --length;
+      }
+    }
+    Chunk& chunk = *chunks.back();
+    size_t line_begin = chunk.line_count == 1 ? 0 : chunk.line_ends[chunk.line_count - 2];
+    size_t rows_before = visual_rows(chunk.line_ends[chunk.line_count - 1] - line_begin, wrap_width);
+    chunk.cells.insert(chunk.cells.end(), row, row + length);
+    chunk.line_ends[chunk.line_count - 1] += length;
+    last_line_continues = wrapped;
+    size_t rows_after = visual_rows(chunk.line_ends[chunk.line_count - 1] - line_begin, wrap_width);
+    chunk_rows.add(chunk_rows.size() - 1, rows_after - (new_line ? 0 : rows_before));
+
+    evict_if_needed();
+  }
+
+  // everything is evicted. line numbers continue from where they were
+  void clear() {
+    first_line = end_line();
+    // keep line numbers chunk aligned
+    first_line = (first_line + LINES_PER_CHUNK - 1) / LINES_PER_CHUNK * LINES_PER_CHUNK;
+    for (DecompressedChunk& d : decompressed) {
+      d = DecompressedChunk();
+    }
+    chunk_rows = PrefixSums();
+    chunk_rows_base = first_line / LINES_PER_CHUNK;
+    spilled.clear();
+    spill_file.reset(); // deletes the file
+    spilled_attribute_ids.assign(spilled_attribute_ids.size(), false);
+    chunks.clear();
+    line_count = 0;
+    used_bytes = 0;
+    last_line_continues = false;
+  }
+
+  // calls f with each attribute id referenced. used for attribute compaction
+  template <typename F>
+  void for_each_attribute_id(F&& f) const {
+    for (size_t id = 0; id < spilled_attribute_ids.size(); ++id) {
+      if (spilled_attribute_ids[id]) {
+        f((uint16_t)id);
+      }
+    }
+    for (const std::unique_ptr<Chunk>& chunk : chunks) {
+      if (chunk->cold()) {
+        // decompressed copies reference the same ids
+        for (uint16_t id : chunk->attribute_ids) {
+          f(id);
+        }
+      } else {
+        for (const Cell& cell : chunk->cells) {
+          f(cell.attributes);
+        }
+      }
+    }
+  }
+};
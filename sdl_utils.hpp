@@ -3,10 +3,23 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "font_utils.hpp"
+#include "glyph_cache_utils.hpp"
 #include "mem_utils.hpp"
 #include "string_utils.hpp"
 
@@ -17,6 +30,20 @@ static constexpr unsigned int CELLS_PER_HEIGHT = 24;
 static constexpr unsigned int SCREEN_WIDTH = CELL_WIDTH * CELLS_PER_WIDTH;
 static constexpr unsigned int SCREEN_HEIGHT = CELL_HEIGHT * CELLS_PER_HEIGHT;
 static constexpr unsigned int FONT_RESOLUTION = 32;
+static constexpr unsigned int MAX_GLYPH_WORKERS = 4;
+// at most this many glyphs are saved to the glyph cache (~3KB each). the warm glyphs go first
+static constexpr size_t GLYPH_CACHE_MAX_GLYPHS = 4096;
+
+// an inclusive range of code points
+struct CodePointRange {
+  char32_t first;
+  char32_t last;
+};
+
+// glyphs that are rasterized when the CharacterManager is created rather than on first use,
+// so the first screens don't draw placeholders. printable ascii, printable latin-1, and the
+// box drawing and block elements that tuis (e.g. htop) draw with
+static constexpr CodePointRange WARM_GLYPHS[] = {{0x20, 0x7E}, {0xA0, 0xFF}, {0x2500, 0x259F}};
 
 UNIQUE_PTR_WRAPPER(WindowPtr, SDL_Window, SDL_DestroyWindow)
 UNIQUE_PTR_WRAPPER(FontPtr, TTF_Font, TTF_CloseFont)
@@ -28,13 +55,41 @@ UNIQUE_PTR_WRAPPER(TexturePtr, SDL_Texture, SDL_DestroyTexture)
 RendererPtr create_renderer(const WindowPtr& w) {
   // wsl nividia driver issue for valgrind (causes segfault):
   // export LIBGL_ALWAYS_SOFTWARE=true
-  RendererPtr ret(SDL_CreateRenderer(w.get(), -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC));
+  RendererPtr ret(SDL_CreateRenderer(w.get(), -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_TARGETTEXTURE));
   if (!ret) {
     fprintf(stderr, "err sdl renderer init: %s", SDL_GetError());
   }
   return ret;
 }
 
+// the time between refreshes of the display the window is on. 60hz if it isn't known
+std::chrono::microseconds get_refresh_interval(const WindowPtr& w) {
+  SDL_DisplayMode mode;
+  if (SDL_GetWindowDisplayMode(w.get(), &mode) != 0 || mode.refresh_rate <= 0) {
+    return std::chrono::microseconds(1000000 / 60);
+  }
+  return std::chrono::microseconds(1000000 / mode.refresh_rate);
+}
+
+// a texture that can be drawn to, and keeps its contents between frames.
+// null for failure: error reason printed
+TexturePtr create_render_target(const RendererPtr& renderer, int width, int height) {
+  TexturePtr ret(SDL_CreateTexture(renderer.get(), SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, width, height));
+  if (!ret) {
+    fprintf(stderr, "err create render target: %s\n", SDL_GetError());
+  }
+  return ret;
+}
+
+// wakes the main loop. safe to call from any thread
+void push_event(Uint32 event_type) {
+  SDL_Event event{};
+  event.type = event_type;
+  if (SDL_PushEvent(&event) < 0) {
+    fprintf(stderr, "err push event: %s\n", SDL_GetError());
+  }
+}
+
 class SDLContext {
   SDLContext() {}
   SDLContext(const SDLContext&) = delete;
@@ -102,95 +157,532 @@ class SDLContext {
   }
 };
 
-// associates UTF8Block with textures. caches
+// renders the code point in white (it's tinted when drawn), as ARGB8888 so it can be copied
+// straight into an atlas. if the font doesn't have it, NO_GLYPH_CHARACTER is rendered instead.
+// only touches the font and the surface, so it can run on any thread that owns the font.
+// null on failure (error printed)
+SurfacePtr rasterize_glyph(TTF_Font* font, char32_t code_point) {
+  // is it drawable? (the code point is always valid, it was checked when parsed)
+  if (TTF_GlyphIsProvided32(font, code_point) == 0) {
+    // it's not drawable
+    code_point = NO_GLYPH_CHARACTER;
+  }
+
+  char utf8_char[MAX_BYTES_PER_CHARACTER + 1];
+  encode_utf8(code_point, utf8_char);
+  auto surface = SurfacePtr(TTF_RenderUTF8_Blended(font, utf8_char, SDL_Color{255, 255, 255}));
+  if (!surface) {
+    fprintf(stderr, "err sdl ttf font render to surface: %s\n", TTF_GetError());
+    return NULL;
+  }
+  auto converted = SurfacePtr(SDL_ConvertSurfaceFormat(surface.get(), SDL_PIXELFORMAT_ARGB8888, 0));
+  if (!converted) {
+    fprintf(stderr, "err convert glyph surface: %s\n", SDL_GetError());
+  }
+  return converted;
+}
+
+// rasterizes glyphs on worker threads, so the first use of a character (e.g. a screen of
+// CJK) doesn't stall the main loop. SDL_ttf fonts can't be shared between threads, so each
+// worker opens its own. requests are taken from a queue, and the surfaces are put in
+// another. the main loop is woken with an event when the finished queue becomes non-empty
+class GlyphRasterizer {
+ public:
+  struct Rasterized {
+    char32_t code_point;
+    SurfacePtr surface; // null if it failed
+  };
+
+ private:
+  struct Shared {
+    std::mutex mutex;
+    std::condition_variable requested;
+    std::condition_variable finished_more; // for take_finished(at_least)
+    std::deque<char32_t> requests;
+    std::vector<Rasterized> finished;
+    bool stopping = false;
+    std::vector<FontPtr> fonts; // one per worker
+  };
+
+  std::unique_ptr<Shared> shared;
+  std::vector<std::thread> workers;
+
+  GlyphRasterizer(std::unique_ptr<Shared> shared) : shared(std::move(shared)) {}
+
+  static void work(Shared& shared, TTF_Font* font, Uint32 event_type) {
+    std::unique_lock<std::mutex> lock(shared.mutex);
+    while (1) {
+      shared.requested.wait(lock, [&]() { return shared.stopping || !shared.requests.empty(); });
+      if (shared.stopping) {
+        return;
+      }
+      char32_t code_point = shared.requests.front();
+      shared.requests.pop_front();
+
+      lock.unlock();
+      SurfacePtr surface = rasterize_glyph(font, code_point);
+      lock.lock();
+
+      // one event per batch. the main loop takes everything that's finished at once
+      if (shared.finished.empty()) {
+        push_event(event_type);
+      }
+      shared.finished.push_back(Rasterized{code_point, std::move(surface)});
+      shared.finished_more.notify_one();
+    }
+  }
+
+ public:
+  // empty for failure: error reason printed.
+  // event_type is pushed when there are finished glyphs to take
+  static std::optional<GlyphRasterizer> create(const SDLContext& ctx, const char* ttf_path, Uint32 event_type) {
+    unsigned int worker_count = std::clamp(std::thread::hardware_concurrency(), 2u, MAX_GLYPH_WORKERS + 1) - 1;
+    auto shared = std::make_unique<Shared>();
+    for (unsigned int i = 0; i < worker_count; ++i) {
+      FontPtr font = ctx.create_font(ttf_path);
+      if (!font) {
+        return {};
+      }
+      shared->fonts.push_back(std::move(font));
+    }
+    GlyphRasterizer ret(std::move(shared));
+    for (const FontPtr& font : ret.shared->fonts) {
+      ret.workers.emplace_back(work, std::ref(*ret.shared), font.get(), event_type);
+    }
+    return ret;
+  }
+
+  GlyphRasterizer(GlyphRasterizer&&) = default;
+
+  void request(char32_t code_point) {
+    {
+      std::lock_guard<std::mutex> lock(shared->mutex);
+      shared->requests.push_back(code_point);
+    }
+    shared->requested.notify_one();
+  }
+
+  // everything that has finished since the last call. first waits until at least
+  // at_least have finished (they must have been requested)
+  std::vector<Rasterized> take_finished(size_t at_least = 0) {
+    std::vector<Rasterized> ret;
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->finished_more.wait(lock, [&]() { return shared->finished.size() >= at_least; });
+    ret.swap(shared->finished);
+    return ret;
+  }
+
+  ~GlyphRasterizer() {
+    if (!shared) {
+      return; // moved from
+    }
+    {
+      std::lock_guard<std::mutex> lock(shared->mutex);
+      shared->stopping = true;
+    }
+    shared->requested.notify_all();
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+  }
+};
+
+// where a glyph is in an atlas texture. texture coordinates are normalized
+struct Glyph {
+  SDL_Texture* texture;
+  float u0, v0, u1, v1;
+};
+
+// associates code points with glyphs. glyphs are rendered once and packed into a
+// few large textures (atlases), so that many can be drawn with a single draw call.
+// packing is by shelf: glyphs from the same font are all the same height, so each
+// shelf is one glyph tall and glyphs are placed left to right until it's full.
+//
+// glyphs are rasterized by a GlyphRasterizer. until a glyph is ready, a placeholder is
+// drawn in its place. upload_finished must be called when the rasterizer's event is received.
+// each atlas has a copy of its pixels in memory. glyphs are packed into that, and the rows that
+// changed are uploaded once per batch rather than once per glyph.
+// glyphs are loaded from a GlyphCache if there is one, and saved to it by save_glyph_cache
 class CharacterManager {
-  FontPtr font;
-  std::unordered_map<UTF8Block, TexturePtr> textures;
+  static constexpr int ATLAS_SIZE = 1024;
+  static constexpr int GLYPH_PADDING = 1; // transparent border. stops filtering from bleeding into neighbours
+  static constexpr int MAX_GLYPH_SIZE = ATLAS_SIZE - 2 * GLYPH_PADDING;
+
+  struct Atlas {
+    TexturePtr texture;
+    std::vector<uint32_t> pixels = std::vector<uint32_t>(ATLAS_SIZE * ATLAS_SIZE, 0); // ARGB8888. transparent where there's no glyph
+    int shelf_x = 0;             // where the next glyph goes on the current shelf
+    int shelf_y = 0;             // top of the current shelf
+    int shelf_height = 0;        // tallest glyph on the current shelf
+    int dirty_top = ATLAS_SIZE;  // rows [dirty_top, dirty_bottom) haven't been uploaded
+    int dirty_bottom = 0;
+  };
+
+  GlyphRasterizer rasterizer;
+  std::vector<Atlas> atlases; // glyphs are added to the last one
+  std::unordered_map<char32_t, Glyph> glyphs;
+  std::unordered_set<char32_t> pending; // requested from the rasterizer, and not uploaded yet
+  Glyph placeholder;                    // NO_GLYPH_CHARACTER. drawn for pending glyphs
+  const Glyph* ascii_glyphs[128] = {};  // points into glyphs. used by get_ascii
+
+  const CodePointRange* warm_glyphs;
+  size_t warm_glyph_ranges;
+
+  std::optional<GlyphCache::Key> cache_key; // empty if there's no glyph cache
+  std::string cache_path;
+  bool cache_stale = false; // glyphs were rasterized that aren't in the cache
+
+  CharacterManager(GlyphRasterizer rasterizer, const CodePointRange* warm_glyphs, size_t warm_glyph_ranges)
+      : rasterizer(std::move(rasterizer)), warm_glyphs(warm_glyphs), warm_glyph_ranges(warm_glyph_ranges) {}
+
+  bool is_warm(char32_t code_point) const {
+    for (size_t i = 0; i < warm_glyph_ranges; ++i) {
+      if (code_point >= warm_glyphs[i].first && code_point <= warm_glyphs[i].last) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // null on failure (error printed)
+  Atlas* create_atlas(const RendererPtr& renderer) {
+    TexturePtr texture(SDL_CreateTexture(renderer.get(), SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, ATLAS_SIZE, ATLAS_SIZE));
+    if (!texture) {
+      fprintf(stderr, "err create atlas: %s\n", SDL_GetError());
+      return NULL;
+    }
+    SDL_SetTextureBlendMode(texture.get(), SDL_BLENDMODE_BLEND);
+    atlases.push_back(Atlas{std::move(texture)});
+    // the initial contents are undefined. the padding between glyphs must be transparent
+    Atlas& atlas = atlases.back();
+    atlas.dirty_top = 0;
+    atlas.dirty_bottom = ATLAS_SIZE;
+    return &atlas;
+  }
+
+  // finds space for the glyph (width by height ARGB8888 pixels, pitch bytes per row) and copies
+  // it in. it's drawable after the next upload_atlases.
+  // returns false on failure (error printed)
+  bool pack(const void* pixels, int width, int height, int pitch, const RendererPtr& renderer, Glyph& out) {
+    int w = width + 2 * GLYPH_PADDING;
+    int h = height + 2 * GLYPH_PADDING;
+    if (width > MAX_GLYPH_SIZE || height > MAX_GLYPH_SIZE) {
+      fprintf(stderr, "err glyph too large for atlas: %dx%d\n", width, height);
+      return false;
+    }
+
+    Atlas* atlas = atlases.empty() ? NULL : &atlases.back();
+    if (atlas && atlas->shelf_x + w > ATLAS_SIZE) {
+      // next shelf
+      atlas->shelf_y += atlas->shelf_height;
+      atlas->shelf_x = 0;
+      atlas->shelf_height = 0;
+    }
+    if (!atlas || atlas->shelf_y + h > ATLAS_SIZE) {
+      atlas = create_atlas(renderer);
+      if (!atlas) {
+        return false;
+      }
+    }
+
+    SDL_Rect dst{atlas->shelf_x + GLYPH_PADDING, atlas->shelf_y + GLYPH_PADDING, width, height};
+    for (int y = 0; y < height; ++y) {
+      const char* row = (const char*)pixels + y * pitch;
+      memcpy(&atlas->pixels[(dst.y + y) * ATLAS_SIZE + dst.x], row, width * sizeof(uint32_t));
+    }
+    atlas->dirty_top = std::min(atlas->dirty_top, dst.y);
+    atlas->dirty_bottom = std::max(atlas->dirty_bottom, dst.y + dst.h);
+    atlas->shelf_x += w;
+    atlas->shelf_height = std::max(atlas->shelf_height, h);
+
+    out.texture = atlas->texture.get();
+    out.u0 = (float)dst.x / ATLAS_SIZE;
+    out.v0 = (float)dst.y / ATLAS_SIZE;
+    out.u1 = (float)(dst.x + dst.w) / ATLAS_SIZE;
+    out.v1 = (float)(dst.y + dst.h) / ATLAS_SIZE;
+    return true;
+  }
+
+  bool pack(const SDL_Surface* surface, const RendererPtr& renderer, Glyph& out) {
+    return pack(surface->pixels, surface->w, surface->h, surface->pitch, renderer, out);
+  }
+
+  // the glyph's pixels in its atlas, as the rect and the atlas' pixels
+  const uint32_t* unpack(const Glyph& glyph, SDL_Rect& rect) const {
+    for (const Atlas& atlas : atlases) {
+      if (atlas.texture.get() == glyph.texture) {
+        rect.x = std::lround(glyph.u0 * ATLAS_SIZE);
+        rect.y = std::lround(glyph.v0 * ATLAS_SIZE);
+        rect.w = std::lround(glyph.u1 * ATLAS_SIZE) - rect.x;
+        rect.h = std::lround(glyph.v1 * ATLAS_SIZE) - rect.y;
+        return atlas.pixels.data();
+      }
+    }
+    return NULL;
+  }
+
+  bool is_placeholder(const Glyph& glyph) const { return glyph.texture == placeholder.texture && glyph.u0 == placeholder.u0 && glyph.v0 == placeholder.v0; }
+
+  // uploads what's changed since the last call. one SDL_UpdateTexture per changed atlas
+  void upload_atlases() {
+    for (Atlas& atlas : atlases) {
+      if (atlas.dirty_top >= atlas.dirty_bottom) {
+        continue;
+      }
+      SDL_Rect rows{0, atlas.dirty_top, ATLAS_SIZE, atlas.dirty_bottom - atlas.dirty_top};
+      if (SDL_UpdateTexture(atlas.texture.get(), &rows, &atlas.pixels[atlas.dirty_top * ATLAS_SIZE], ATLAS_SIZE * sizeof(uint32_t)) != 0) {
+        fprintf(stderr, "err upload atlas: %s\n", SDL_GetError());
+      }
+      atlas.dirty_top = ATLAS_SIZE;
+      atlas.dirty_bottom = 0;
+    }
+  }
+
+  // packs the rasterized glyphs and uploads them
+  void upload(std::vector<GlyphRasterizer::Rasterized>& rasterized, const RendererPtr& renderer) {
+    for (GlyphRasterizer::Rasterized& r : rasterized) {
+      Glyph glyph = placeholder; // if it failed, the placeholder is used from now on
+      if (r.surface) {
+        pack(r.surface.get(), renderer, glyph);
+        cache_stale = true;
+      }
+      glyphs.emplace(r.code_point, glyph);
+      pending.erase(r.code_point);
+    }
+    upload_atlases();
+  }
 
  public:
-  // search for a monospace font and use that as the default
-  static std::optional<CharacterManager> create(const SDLContext& ctx) {
+  // search for a monospace font and use that as the default.
+  // event_type is pushed when rasterized glyphs are ready to upload.
+  // glyphs are cached in cache_dir (no cache if it's empty).
+  // the warm glyphs that aren't in the cache are rasterized in parallel, and everything is
+  // uploaded together before this returns
+  static std::optional<CharacterManager> create(const SDLContext& ctx, const RendererPtr& renderer, Uint32 event_type, //
+                                                const std::string& cache_dir,                                       //
+                                                const CodePointRange* warm_glyphs = WARM_GLYPHS,                  //
+                                                size_t warm_glyph_ranges = std::size(WARM_GLYPHS)) {
     UniqMalloc um = get_mono_ttf();
     if (!um) {
       return {};
     }
-    FontPtr mono_font = ctx.create_font((char*)um.get());
-    if (!mono_font) {
+    const char* font_path = (char*)um.get();
+
+    std::optional<GlyphRasterizer> rasterizer = GlyphRasterizer::create(ctx, font_path, event_type);
+    if (!rasterizer) {
       return {};
     }
-    CharacterManager cm(std::move(mono_font));
-    return std::move(cm);
-  }
-
-  CharacterManager(FontPtr font) : font(std::move(font)) {}
-
-  // pointer depends on the lifetime of this instance.
-  // null on failure (error printed)
-  SDL_Texture* get(UTF8Block utf8_char, const RendererPtr& renderer) {
-    auto it = textures.find(utf8_char);
-    if (it != textures.cend()) {
-      // texure has already been renderer
-      return it->second.get();
-    } else {
-      // texture must be generated and inserted
+    CharacterManager cm(std::move(*rasterizer), warm_glyphs, warm_glyph_ranges);
 
-      // see if the char is valid
-      std::optional<wchar_t> maybe_wc = utf8_char.to_wc();
-      wchar_t wc;
-      if (maybe_wc.has_value()) {
-        // it it is, then use it
-        wc = *maybe_wc;
-      } else {
-        // not valid UTF-8. use the character that represents something invalid
-        utf8_char = UTF8Block::invalid_utf8();
-        wc = *utf8_char.to_wc();
+    if (!cache_dir.empty()) {
+      cm.cache_key = GlyphCache::key_for(font_path, FONT_RESOLUTION);
+    }
+    bool has_placeholder = false;
+    if (cm.cache_key) {
+      cm.cache_path = GlyphCache::path_for(cache_dir, *cm.cache_key);
+      std::optional<GlyphCache> cache = GlyphCache::open(cm.cache_path, *cm.cache_key, MAX_GLYPH_SIZE);
+      for (size_t i = 0; cache && i < cache->size(); ++i) {
+        const GlyphCache::Entry& e = (*cache)[i];
+        Glyph glyph;
+        if (!cm.pack(cache->pixels(e), e.width, e.height, e.width * sizeof(uint32_t), renderer, glyph)) {
+          // start over without the cache. if the atlas itself can't be made, the placeholder fails below
+          unlink(cm.cache_path.c_str());
+          cache.reset();
+          cm.atlases.clear();
+          cm.glyphs.clear();
+          has_placeholder = false;
+          break;
+        }
+        if (e.code_point == NO_GLYPH_CHARACTER) {
+          cm.placeholder = glyph;
+          has_placeholder = true;
+        }
+        cm.glyphs.emplace(e.code_point, glyph);
       }
+      cm.cache_stale = !cache;
+    }
 
-      // given the character in wide char form, is it drawable?
-      int has_glyph;
-      if (sizeof(wchar_t) == 2) {
-        has_glyph = TTF_GlyphIsProvided(this->font.get(), wc);
-      } else { // 4 byte. only 2 or 4 is possible
-        has_glyph = TTF_GlyphIsProvided32(this->font.get(), wc);
+    if (!has_placeholder) {
+      // the placeholder is needed right away, so it's done here rather than by the workers
+      FontPtr mono_font = ctx.create_font(font_path);
+      if (!mono_font) {
+        return {};
       }
+      SurfacePtr surface = rasterize_glyph(mono_font.get(), NO_GLYPH_CHARACTER);
+      if (!surface || !cm.pack(surface.get(), renderer, cm.placeholder)) {
+        return {};
+      }
+      cm.cache_stale = true;
+    }
 
-      if (has_glyph == 0) {
-        // it's not drawable
-        utf8_char = UTF8Block::no_glyph();
+    for (size_t i = 0; i < warm_glyph_ranges; ++i) {
+      for (char32_t code_point = warm_glyphs[i].first; code_point <= warm_glyphs[i].last; ++code_point) {
+        cm.get(code_point); // requests it if it wasn't cached
       }
+    }
+    std::vector<GlyphRasterizer::Rasterized> warmed = cm.rasterizer.take_finished(cm.pending.size());
+    cm.upload(warmed, renderer);
+    return std::move(cm);
+  }
 
-      // create the surface for the character
-      // render with white, since it can be tinted later with SDL_SetTextureColorMod
-      auto surface = SurfacePtr(TTF_RenderUTF8_Blended(this->font.get(), //
-                                                       utf8_char.data,   //
-                                                       SDL_Color{255, 255, 255}));
-      if (!surface) {
-        fprintf(stderr, "err sdl ttf font render to surface: %s\n", TTF_GetError());
-        return NULL;
+  // writes the glyphs to the glyph cache, if anything was rasterized since it was loaded.
+  // up to GLYPH_CACHE_MAX_GLYPHS: the placeholder and the warm glyphs, then the rest
+  void save_glyph_cache() const {
+    if (!cache_key || !cache_stale) {
+      return;
+    }
+    std::vector<char32_t> code_points;
+    code_points.push_back(NO_GLYPH_CHARACTER); // the placeholder
+    for (const auto& [code_point, glyph] : glyphs) {
+      // glyphs that failed are rasterized again next time
+      if (code_point != NO_GLYPH_CHARACTER && !is_placeholder(glyph)) {
+        code_points.push_back(code_point);
       }
+    }
+    std::stable_partition(code_points.begin() + 1, code_points.end(), [&](char32_t c) { return is_warm(c); });
+    code_points.resize(std::min(code_points.size(), GLYPH_CACHE_MAX_GLYPHS));
 
-      // convert the surface to a texture on gpu
-      auto texture = TexturePtr(SDL_CreateTextureFromSurface(renderer.get(), surface.get()));
-      if (!texture) {
-        fprintf(stderr, "err sdl ttf font surface to texture: %s\n", TTF_GetError());
-        return NULL;
+    std::vector<GlyphCache::Entry> entries;
+    std::vector<uint32_t> pixels;
+    for (char32_t code_point : code_points) {
+      const Glyph& glyph = code_point == NO_GLYPH_CHARACTER ? placeholder : glyphs.at(code_point);
+      SDL_Rect rect;
+      const uint32_t* atlas_pixels = unpack(glyph, rect);
+      if (!atlas_pixels) {
+        continue;
+      }
+      entries.push_back(GlyphCache::Entry{code_point, (uint16_t)rect.w, (uint16_t)rect.h, pixels.size() * sizeof(uint32_t)});
+      for (int y = 0; y < rect.h; ++y) {
+        const uint32_t* row = atlas_pixels + (rect.y + y) * ATLAS_SIZE + rect.x;
+        pixels.insert(pixels.end(), row, row + rect.w);
       }
+    }
+    GlyphCache::save(cache_path, *cache_key, std::move(entries), pixels);
+  }
 
-      auto inserted_it = textures.emplace_hint(it, utf8_char, std::move(texture));
-      return inserted_it->second.get();
+  // pointer depends on the lifetime of this instance. never null.
+  // the placeholder if the glyph isn't ready yet (it's requested if needed)
+  const Glyph* get(char32_t code_point) {
+    auto it = glyphs.find(code_point);
+    if (it != glyphs.cend()) {
+      // glyph has already been rendered
+      return &it->second;
+    }
+    if (pending.insert(code_point).second) {
+      rasterizer.request(code_point);
     }
+    return &placeholder;
+  }
+
+  // same as get, but for a single ascii character. skips the hash lookup after the first call
+  const Glyph* get_ascii(char c) {
+    const Glyph*& cached = ascii_glyphs[(unsigned char)c & 0x7F];
+    if (cached) {
+      return cached;
+    }
+    const Glyph* ret = get((unsigned char)c & 0x7F);
+    if (ret != &placeholder) {
+      cached = ret;
+    }
+    return ret;
   }
-};
 
-struct CellAttributes {
-  Color fg{255, 255, 255};
-  Color bg;
-  bool italic = false;
-  bool bold = false;
-  bool underline = false;
+  // packs the glyphs that the rasterizer has finished into the atlases.
+  // returns true if any were added (anything drawn with the placeholder should be drawn again)
+  bool upload_finished(const RendererPtr& renderer) {
+    std::vector<GlyphRasterizer::Rasterized> finished = rasterizer.take_finished();
+    upload(finished, renderer);
+    return !finished.empty();
+  }
 };
 
-struct Cell {
-  SDL_Texture* texture;
-  CellAttributes attributes;
+// quads collected over a frame, then submitted with one SDL_RenderGeometry call
+// per texture (so a full screen is a handful of draw calls, rather than a few per cell).
+// solid fills are grouped by color and drawn first with one SDL_RenderFillRects call
+// per color, under everything else. colors are drawn in the order they were first filled
+class QuadBatch {
+  struct Geometry {
+    SDL_Texture* texture;
+    std::vector<SDL_Vertex> vertices;
+    std::vector<int> indices;
+  };
+  std::vector<Geometry> geometries; // one per atlas
+
+  struct Fills {
+    SDL_Color color;
+    std::vector<SDL_Rect> rects;
+  };
+  std::vector<Fills> fills; // the first used_fills are in use. the rest keep their capacity
+  size_t used_fills = 0;
+  std::unordered_map<uint32_t, size_t> fill_by_color; // packed rgb to index in fills
+
+  Geometry& get_geometry(SDL_Texture* texture) {
+    // only a few textures, so a linear search is fine
+    for (Geometry& g : geometries) {
+      if (g.texture == texture) {
+        return g;
+      }
+    }
+    geometries.push_back(Geometry{texture, {}, {}});
+    return geometries.back();
+  }
+
+  static void add_quad(Geometry& g, const SDL_Rect& dst, SDL_Color color, float u0, float v0, float u1, float v1) {
+    int first = g.vertices.size();
+    float x0 = dst.x, y0 = dst.y, x1 = dst.x + dst.w, y1 = dst.y + dst.h;
+    g.vertices.push_back(SDL_Vertex{{x0, y0}, color, {u0, v0}});
+    g.vertices.push_back(SDL_Vertex{{x1, y0}, color, {u1, v0}});
+    g.vertices.push_back(SDL_Vertex{{x1, y1}, color, {u1, v1}});
+    g.vertices.push_back(SDL_Vertex{{x0, y1}, color, {u0, v1}});
+    for (int i : {0, 1, 2, 0, 2, 3}) {
+      g.indices.push_back(first + i);
+    }
+  }
+
+ public:
+  void fill(const SDL_Rect& dst, SDL_Color color) {
+    uint32_t packed = (uint32_t)color.r << 16 | (uint32_t)color.g << 8 | color.b;
+    auto it = fill_by_color.find(packed);
+    if (it == fill_by_color.end()) {
+      if (used_fills == fills.size()) {
+        fills.emplace_back();
+      }
+      fills[used_fills].color = color;
+      it = fill_by_color.emplace(packed, used_fills++).first;
+    }
+    fills[it->second].rects.push_back(dst);
+  }
+
+  // the glyph is tinted by color
+  void copy(const Glyph& glyph, const SDL_Rect& dst, SDL_Color color) {
+    add_quad(get_geometry(glyph.texture), dst, color, glyph.u0, glyph.v0, glyph.u1, glyph.v1);
+  }
+
+  // draws everything, and empties the batch (keeping its capacity for the next frame).
+  // returns false on failure (error printed)
+  bool flush(const RendererPtr& renderer) {
+    bool ret = true;
+    for (size_t i = 0; i < used_fills; ++i) {
+      Fills& f = fills[i];
+      SDL_SetRenderDrawColor(renderer.get(), f.color.r, f.color.g, f.color.b, 255);
+      if (SDL_RenderFillRects(renderer.get(), f.rects.data(), f.rects.size()) != 0) {
+        fprintf(stderr, "err render fill rects: %s\n", SDL_GetError());
+        ret = false;
+      }
+      f.rects.clear();
+    }
+    used_fills = 0;
+    fill_by_color.clear();
+
+    for (Geometry& g : geometries) {
+      if (!g.indices.empty() &&
+          SDL_RenderGeometry(renderer.get(), g.texture, g.vertices.data(), g.vertices.size(), g.indices.data(), g.indices.size()) != 0) {
+        fprintf(stderr, "err render geometry: %s\n", SDL_GetError());
+        ret = false;
+      }
+      g.vertices.clear();
+      g.indices.clear();
+    }
+    return ret;
+  }
 };
@@ -1,17 +1,242 @@
 #pragma once
 
-#include <cassert>
+#include <array>
+#include <cstddef>
 
-#define SM_ENTER_STATE(state_machine_name, state_name) goto state_machine_label_##state_name##_for_##state_machine_name
+// the DEC ANSI parser from https://vt100.net/emu/dec_ansi_parser, compiled into a
+// table. each byte is first mapped to a class, then the (state, class) pair gives
+// the action to take and the next state. the entry and exit actions from the
+// diagram are folded into the transitions that cause them (e.g. CLEAR on the way
+// into CSI_ENTRY, OSC_END on the way out of OSC_STRING).
+//
+// bytes >= 0x80 are never C1 controls here since the stream is utf8. in GROUND
+// they are printed (assembled into utf8 characters), in strings they are data,
+// and elsewhere they are ignored.
 
-#define SM_DEFINE_STATE_BEGIN(state_machine_name, state_name) \
-  do {                                                        \
-    state_machine_label_##state_name##_for_##state_machine_name : {
+enum class VTState : unsigned char {
+  GROUND,
+  ESCAPE,
+  ESCAPE_INTERMEDIATE,
+  CSI_ENTRY,
+  CSI_PARAM,
+  CSI_INTERMEDIATE,
+  CSI_IGNORE,
+  DCS_ENTRY,
+  DCS_PARAM,
+  DCS_INTERMEDIATE,
+  DCS_PASSTHROUGH,
+  DCS_IGNORE,
+  OSC_STRING,
+  SOS_PM_APC_STRING,
+  COUNT,
+};
 
+enum class VTAction : unsigned char {
+  NONE, // also used for "ignore"
+  PRINT,
+  EXECUTE,
+  CLEAR,
+  COLLECT,
+  PARAM,
+  ESC_DISPATCH,
+  CSI_DISPATCH,
+  HOOK,
+  PUT,
+  UNHOOK,
+  OSC_START,
+  OSC_PUT,
+  OSC_END,
+  COUNT,
+};
 
-      
-#define SM_END_STATE()                                       \
-  }                                                          \
-  assert(false && "state machine state can't fall through"); \
-  }                                                          \
-  while (0)
+enum class VTByteClass : unsigned char {
+  C0,             // 0x00-0x06, 0x08-0x17, 0x19, 0x1C-0x1F
+  BEL,            // 0x07. also terminates OSC (xterm)
+  CAN_SUB,        // 0x18, 0x1A. aborts a sequence from any state
+  ESC,            // 0x1B
+  INTERMEDIATE,   // 0x20-0x2F
+  DIGIT,          // 0x30-0x39
+  COLON,          // 0x3A
+  SEMICOLON,      // 0x3B
+  PRIVATE_MARKER, // 0x3C-0x3F
+  DCS_INTRODUCER, // 'P'
+  SOS_PM_APC,     // 'X', '^', '_'
+  CSI_INTRODUCER, // '['
+  OSC_INTRODUCER, // ']'
+  FINAL,          // the rest of 0x40-0x7E
+  DEL,            // 0x7F
+  HIGH,           // 0x80-0xFF
+  COUNT,
+};
+
+static_assert((size_t)VTState::COUNT <= 16 && (size_t)VTAction::COUNT <= 16, "transitions are packed as two nibbles");
+
+constexpr std::array<VTByteClass, 256> make_vt_byte_classes() {
+  std::array<VTByteClass, 256> ret{};
+  for (size_t c = 0; c < 256; ++c) {
+    VTByteClass cls = VTByteClass::HIGH;
+    if (c == 0x07) {
+      cls = VTByteClass::BEL;
+    } else if (c == 0x18 || c == 0x1A) {
+      cls = VTByteClass::CAN_SUB;
+    } else if (c == 0x1B) {
+      cls = VTByteClass::ESC;
+    } else if (c < 0x20) {
+      cls = VTByteClass::C0;
+    } else if (c < 0x30) {
+      cls = VTByteClass::INTERMEDIATE;
+    } else if (c < 0x3A) {
+      cls = VTByteClass::DIGIT;
+    } else if (c == 0x3A) {
+      cls = VTByteClass::COLON;
+    } else if (c == 0x3B) {
+      cls = VTByteClass::SEMICOLON;
+    } else if (c < 0x40) {
+      cls = VTByteClass::PRIVATE_MARKER;
+    } else if (c == 'P') {
+      cls = VTByteClass::DCS_INTRODUCER;
+    } else if (c == 'X' || c == '^' || c == '_') {
+      cls = VTByteClass::SOS_PM_APC;
+    } else if (c == '[') {
+      cls = VTByteClass::CSI_INTRODUCER;
+    } else if (c == ']') {
+      cls = VTByteClass::OSC_INTRODUCER;
+    } else if (c < 0x7F) {
+      cls = VTByteClass::FINAL;
+    } else if (c == 0x7F) {
+      cls = VTByteClass::DEL;
+    }
+    ret[c] = cls;
+  }
+  return ret;
+}
+
+static constexpr std::array<VTByteClass, 256> VT_BYTE_CLASSES = make_vt_byte_classes();
+
+using VTTransitionTable = std::array<std::array<unsigned char, (size_t)VTByteClass::COUNT>, (size_t)VTState::COUNT>;
+
+constexpr unsigned char vt_transition(VTAction action, VTState next) {
+  return (unsigned char)(((unsigned char)action << 4) | (unsigned char)next);
+}
+
+constexpr VTAction vt_transition_action(unsigned char transition) {
+  return (VTAction)(transition >> 4);
+}
+
+constexpr VTState vt_transition_state(unsigned char transition) {
+  return (VTState)(transition & 0xF);
+}
+
+constexpr VTTransitionTable make_vt_transitions() {
+  VTTransitionTable ret{};
+
+  // sets the transition for an inclusive range of byte classes
+  auto on = [&](VTState state, VTByteClass first, VTByteClass last, VTAction action, VTState next) {
+    for (size_t cls = (size_t)first; cls <= (size_t)last; ++cls) {
+      ret[(size_t)state][cls] = vt_transition(action, next);
+    }
+  };
+
+  auto on1 = [&](VTState state, VTByteClass cls, VTAction action, VTState next) { //
+    on(state, cls, cls, action, next);
+  };
+
+  using S = VTState;
+  using C = VTByteClass;
+  using A = VTAction;
+
+  // default for every state is to ignore the byte and stay put
+  for (size_t state = 0; state < (size_t)S::COUNT; ++state) {
+    on((S)state, C::C0, C::HIGH, A::NONE, (S)state);
+  }
+
+  // ================================ "anywhere" transitions ===================
+  for (size_t state = 0; state < (size_t)S::COUNT; ++state) {
+    on1((S)state, C::CAN_SUB, A::EXECUTE, S::GROUND);
+    on1((S)state, C::ESC, A::CLEAR, S::ESCAPE);
+  }
+  on1(S::DCS_PASSTHROUGH, C::CAN_SUB, A::UNHOOK, S::GROUND);
+  on1(S::DCS_PASSTHROUGH, C::ESC, A::UNHOOK, S::ESCAPE);
+  on1(S::OSC_STRING, C::CAN_SUB, A::OSC_END, S::GROUND);
+  on1(S::OSC_STRING, C::ESC, A::OSC_END, S::ESCAPE);
+
+  // ================================ GROUND ===================================
+  on(S::GROUND, C::C0, C::BEL, A::EXECUTE, S::GROUND);
+  on(S::GROUND, C::INTERMEDIATE, C::FINAL, A::PRINT, S::GROUND);
+  on1(S::GROUND, C::HIGH, A::PRINT, S::GROUND);
+
+  // ================================ ESCAPE ===================================
+  on(S::ESCAPE, C::C0, C::BEL, A::EXECUTE, S::ESCAPE);
+  on1(S::ESCAPE, C::INTERMEDIATE, A::COLLECT, S::ESCAPE_INTERMEDIATE);
+  on(S::ESCAPE, C::DIGIT, C::FINAL, A::ESC_DISPATCH, S::GROUND);
+  on1(S::ESCAPE, C::DCS_INTRODUCER, A::CLEAR, S::DCS_ENTRY);
+  on1(S::ESCAPE, C::SOS_PM_APC, A::NONE, S::SOS_PM_APC_STRING);
+  on1(S::ESCAPE, C::CSI_INTRODUCER, A::CLEAR, S::CSI_ENTRY);
+  on1(S::ESCAPE, C::OSC_INTRODUCER, A::OSC_START, S::OSC_STRING);
+  on1(S::ESCAPE, C::HIGH, A::PRINT, S::GROUND); // malformed. don't lose the character
+
+  on(S::ESCAPE_INTERMEDIATE, C::C0, C::BEL, A::EXECUTE, S::ESCAPE_INTERMEDIATE);
+  on1(S::ESCAPE_INTERMEDIATE, C::INTERMEDIATE, A::COLLECT, S::ESCAPE_INTERMEDIATE);
+  on(S::ESCAPE_INTERMEDIATE, C::DIGIT, C::FINAL, A::ESC_DISPATCH, S::GROUND);
+
+  // ================================ CSI ======================================
+  on(S::CSI_ENTRY, C::C0, C::BEL, A::EXECUTE, S::CSI_ENTRY);
+  on1(S::CSI_ENTRY, C::INTERMEDIATE, A::COLLECT, S::CSI_INTERMEDIATE);
+  on1(S::CSI_ENTRY, C::DIGIT, A::PARAM, S::CSI_PARAM);
+  on1(S::CSI_ENTRY, C::COLON, A::NONE, S::CSI_IGNORE);
+  on1(S::CSI_ENTRY, C::SEMICOLON, A::PARAM, S::CSI_PARAM);
+  on1(S::CSI_ENTRY, C::PRIVATE_MARKER, A::COLLECT, S::CSI_PARAM);
+  on(S::CSI_ENTRY, C::DCS_INTRODUCER, C::FINAL, A::CSI_DISPATCH, S::GROUND);
+
+  on(S::CSI_PARAM, C::C0, C::BEL, A::EXECUTE, S::CSI_PARAM);
+  on1(S::CSI_PARAM, C::INTERMEDIATE, A::COLLECT, S::CSI_INTERMEDIATE);
+  on1(S::CSI_PARAM, C::DIGIT, A::PARAM, S::CSI_PARAM);
+  on1(S::CSI_PARAM, C::COLON, A::NONE, S::CSI_IGNORE);
+  on1(S::CSI_PARAM, C::SEMICOLON, A::PARAM, S::CSI_PARAM);
+  on1(S::CSI_PARAM, C::PRIVATE_MARKER, A::NONE, S::CSI_IGNORE);
+  on(S::CSI_PARAM, C::DCS_INTRODUCER, C::FINAL, A::CSI_DISPATCH, S::GROUND);
+
+  on(S::CSI_INTERMEDIATE, C::C0, C::BEL, A::EXECUTE, S::CSI_INTERMEDIATE);
+  on1(S::CSI_INTERMEDIATE, C::INTERMEDIATE, A::COLLECT, S::CSI_INTERMEDIATE);
+  on(S::CSI_INTERMEDIATE, C::DIGIT, C::PRIVATE_MARKER, A::NONE, S::CSI_IGNORE);
+  on(S::CSI_INTERMEDIATE, C::DCS_INTRODUCER, C::FINAL, A::CSI_DISPATCH, S::GROUND);
+
+  on(S::CSI_IGNORE, C::C0, C::BEL, A::EXECUTE, S::CSI_IGNORE);
+  on(S::CSI_IGNORE, C::DCS_INTRODUCER, C::FINAL, A::NONE, S::GROUND);
+
+  // ================================ DCS ======================================
+  on1(S::DCS_ENTRY, C::INTERMEDIATE, A::COLLECT, S::DCS_INTERMEDIATE);
+  on1(S::DCS_ENTRY, C::DIGIT, A::PARAM, S::DCS_PARAM);
+  on1(S::DCS_ENTRY, C::COLON, A::NONE, S::DCS_IGNORE);
+  on1(S::DCS_ENTRY, C::SEMICOLON, A::PARAM, S::DCS_PARAM);
+  on1(S::DCS_ENTRY, C::PRIVATE_MARKER, A::COLLECT, S::DCS_PARAM);
+  on(S::DCS_ENTRY, C::DCS_INTRODUCER, C::FINAL, A::HOOK, S::DCS_PASSTHROUGH);
+
+  on1(S::DCS_PARAM, C::INTERMEDIATE, A::COLLECT, S::DCS_INTERMEDIATE);
+  on1(S::DCS_PARAM, C::DIGIT, A::PARAM, S::DCS_PARAM);
+  on1(S::DCS_PARAM, C::COLON, A::NONE, S::DCS_IGNORE);
+  on1(S::DCS_PARAM, C::SEMICOLON, A::PARAM, S::DCS_PARAM);
+  on1(S::DCS_PARAM, C::PRIVATE_MARKER, A::NONE, S::DCS_IGNORE);
+  on(S::DCS_PARAM, C::DCS_INTRODUCER, C::FINAL, A::HOOK, S::DCS_PASSTHROUGH);
+
+  on1(S::DCS_INTERMEDIATE, C::INTERMEDIATE, A::COLLECT, S::DCS_INTERMEDIATE);
+  on(S::DCS_INTERMEDIATE, C::DIGIT, C::PRIVATE_MARKER, A::NONE, S::DCS_IGNORE);
+  on(S::DCS_INTERMEDIATE, C::DCS_INTRODUCER, C::FINAL, A::HOOK, S::DCS_PASSTHROUGH);
+
+  on(S::DCS_PASSTHROUGH, C::C0, C::BEL, A::PUT, S::DCS_PASSTHROUGH);
+  on(S::DCS_PASSTHROUGH, C::INTERMEDIATE, C::FINAL, A::PUT, S::DCS_PASSTHROUGH);
+  on1(S::DCS_PASSTHROUGH, C::HIGH, A::PUT, S::DCS_PASSTHROUGH);
+
+  // DCS_IGNORE ignores everything until ESC or CAN/SUB (the defaults)
+
+  // ================================ strings ==================================
+  on1(S::OSC_STRING, C::BEL, A::OSC_END, S::GROUND);
+  on(S::OSC_STRING, C::INTERMEDIATE, C::DEL, A::OSC_PUT, S::OSC_STRING);
+  on1(S::OSC_STRING, C::HIGH, A::OSC_PUT, S::OSC_STRING);
+
+  // SOS_PM_APC_STRING ignores everything until ESC or CAN/SUB (the defaults)
+
+  return ret;
+}
+
+static constexpr VTTransitionTable VT_TRANSITIONS = make_vt_transitions();
@@ -1,13 +1,16 @@
 #pragma once
 
+#include <array>
 #include <cassert>
-#include <cstring>
-#include <cwchar>
-#include <optional>
-#include <string_view>
+#include <cstdint>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include "color.hpp"
 #include "state_machine.hpp"
 
@@ -17,121 +20,200 @@ void append_to_buffer(std::vector<T>& buf, const T* begin, const T* end) {
   std::copy(begin, end, &*buf.end() - (end - begin));
 }
 
-// a utf8 character has a maximum size of 4 bytes.
-static constexpr size_t MAX_BYTES_PER_CHARACTER = 4;
-
-// this can contain invalid UTF-8. The only guarentee is that the character has
-// a completed length (as indicated by it's first byte). Also it will never be empty.
-struct UTF8Block {
-  // +1 so it's always null terminating, even at largest length
-  char data[MAX_BYTES_PER_CHARACTER + 1];
-
-  // c is the first byte of a utf8 multibyte sequence. returns the length of the multibyte
-  // returns -1 on error. e.g. this is a continuation byte
-  static int u8_length(unsigned char c) {
-    if (c < 0b10000000) {
-      return 1;
-    } else if ((c & 0b11100000) == 0b11000000) {
-      return 2;
-    } else if ((c & 0b11110000) == 0b11100000) {
-      return 3;
-    } else if ((c & 0b11111000) == 0b11110000) {
-      return 4;
-    } else {
-      return -1;
+// returns the number of leading bytes in data that are printable ascii (space to '~').
+// stops at the first escape, control byte, DEL, or byte that's part of a utf8 multibyte.
+// the vector paths are chosen at compile time (-mavx2 or -march=native for AVX2,
+// x86-64 always has SSE2), otherwise it's a plain loop
+size_t printable_ascii_length(const char* data, size_t length) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i space32 = _mm256_set1_epi8(' ');
+  const __m256i del32 = _mm256_set1_epi8(0x7F);
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    // signed compare. bytes >= 0x80 are negative, so they are caught by the same compare as control bytes
+    __m256i stop = _mm256_or_si256(_mm256_cmpgt_epi8(space32, v), _mm256_cmpeq_epi8(v, del32));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(stop);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
     }
   }
-
-  static UTF8Block space() {
-    UTF8Block ret;
-    ret.data[0] = ' ';
-    return ret;
+#endif
+#if defined(__SSE2__)
+  const __m128i space16 = _mm_set1_epi8(' ');
+  const __m128i del16 = _mm_set1_epi8(0x7F);
+  for (; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    __m128i stop = _mm_or_si128(_mm_cmplt_epi8(v, space16), _mm_cmpeq_epi8(v, del16));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(stop);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
   }
-
-  static UTF8Block debug() {
-    UTF8Block ret;
-    ret.data[0] = 'X';
-    return ret;
+#endif
+  for (; i < length; ++i) {
+    unsigned char c = data[i];
+    if (c < ' ' || c >= 0x7F) {
+      break;
+    }
   }
+  return i;
+}
 
-  static UTF8Block stray_continuation() {
-    UTF8Block ret; // https://www.fileformat.info/info/unicode/char/fffd/index.htm
-    ret.data[0] = 0xEF;
-    ret.data[1] = 0xBF;
-    ret.data[2] = 0xBD;
-    return ret;
-  }
+// a utf8 character has a maximum size of 4 bytes.
+static constexpr size_t MAX_BYTES_PER_CHARACTER = 4;
 
-  // Used to represent an invalid UTF-8 character.
-  static UTF8Block invalid_utf8() {
-    UTF8Block ret; // https://www.fileformat.info/info/unicode/char/fffc/index.htm
-    ret.data[0] = 0xEF;
-    ret.data[1] = 0xBF;
-    ret.data[2] = 0xBC;
-    return ret;
+// https://www.fileformat.info/info/unicode/char/fffd/index.htm
+// used in place of anything that isn't valid utf8
+static constexpr char32_t REPLACEMENT_CHARACTER = 0xFFFD;
+
+// https://www.fileformat.info/info/unicode/char/25a1/index.htm
+// used to represent anything that doesn't have a glyph in the font
+static constexpr char32_t NO_GLYPH_CHARACTER = 0x25A1;
+
+// writes the utf8 encoding of a valid code point to out, followed by a null.
+// returns the number of bytes, excluding the null
+size_t encode_utf8(char32_t cp, char (&out)[MAX_BYTES_PER_CHARACTER + 1]) {
+  size_t length;
+  if (cp < 0x80) {
+    out[0] = cp;
+    length = 1;
+  } else if (cp < 0x800) {
+    out[0] = 0b11000000 | (cp >> 6);
+    out[1] = 0b10000000 | (cp & 0b111111);
+    length = 2;
+  } else if (cp < 0x10000) {
+    out[0] = 0b11100000 | (cp >> 12);
+    out[1] = 0b10000000 | ((cp >> 6) & 0b111111);
+    out[2] = 0b10000000 | (cp & 0b111111);
+    length = 3;
+  } else {
+    out[0] = 0b11110000 | (cp >> 18);
+    out[1] = 0b10000000 | ((cp >> 12) & 0b111111);
+    out[2] = 0b10000000 | ((cp >> 6) & 0b111111);
+    out[3] = 0b10000000 | (cp & 0b111111);
+    length = 4;
   }
+  out[length] = '\0';
+  return length;
+}
 
-  // Used to represent anything that doesn't have a glyph in this font
-  static UTF8Block no_glyph() {
-    UTF8Block ret; // https://www.fileformat.info/info/unicode/char/25a1/index.htm
-    ret.data[0] = 0xE2;
-    ret.data[1] = 0x96;
-    ret.data[2] = 0xA1;
-    return ret;
-  }
+// utf8 validation as a DFA over byte classes, following the well-formed byte
+// sequences table (table 3-7) of the unicode standard. this rejects overlongs,
+// surrogates and anything above U+10FFFF as soon as the offending byte is seen
+enum class UTF8State : unsigned char {
+  ACCEPT, // between characters
+  REJECT,
+  NEED1,  // need one more continuation byte
+  NEED2,
+  NEED3,
+  AFTER_E0, // next must be A0..BF (no overlongs)
+  AFTER_ED, // next must be 80..9F (no surrogates)
+  AFTER_F0, // next must be 90..BF (no overlongs)
+  AFTER_F4, // next must be 80..8F (nothing above U+10FFFF)
+  COUNT,
+};
 
-  UTF8Block() { memset(data, 0, sizeof(data)); }
+enum class UTF8ByteClass : unsigned char {
+  ASCII,
+  CONTINUATION_80, // 80..8F
+  CONTINUATION_90, // 90..9F
+  CONTINUATION_A0, // A0..BF
+  LEAD2,           // C2..DF
+  E0,
+  LEAD3, // E1..EC, EE..EF
+  ED,
+  F0,
+  LEAD4, // F1..F3
+  F4,
+  INVALID, // C0, C1, F5..FF
+  COUNT,
+};
 
-  UTF8Block(const UTF8Block& other) { *this = other; }
+constexpr std::array<UTF8ByteClass, 256> make_utf8_byte_classes() {
+  std::array<UTF8ByteClass, 256> ret{};
+  for (size_t c = 0; c < 256; ++c) {
+    UTF8ByteClass cls = UTF8ByteClass::INVALID;
+    if (c < 0x80) {
+      cls = UTF8ByteClass::ASCII;
+    } else if (c < 0x90) {
+      cls = UTF8ByteClass::CONTINUATION_80;
+    } else if (c < 0xA0) {
+      cls = UTF8ByteClass::CONTINUATION_90;
+    } else if (c < 0xC0) {
+      cls = UTF8ByteClass::CONTINUATION_A0;
+    } else if (c >= 0xC2 && c < 0xE0) {
+      cls = UTF8ByteClass::LEAD2;
+    } else if (c == 0xE0) {
+      cls = UTF8ByteClass::E0;
+    } else if (c == 0xED) {
+      cls = UTF8ByteClass::ED;
+    } else if (c > 0xE0 && c < 0xF0) {
+      cls = UTF8ByteClass::LEAD3;
+    } else if (c == 0xF0) {
+      cls = UTF8ByteClass::F0;
+    } else if (c > 0xF0 && c < 0xF4) {
+      cls = UTF8ByteClass::LEAD4;
+    } else if (c == 0xF4) {
+      cls = UTF8ByteClass::F4;
+    }
+    ret[c] = cls;
+  }
+  return ret;
+}
 
-  UTF8Block(UTF8Block&& other) { *this = std::move(other); }
+static constexpr std::array<UTF8ByteClass, 256> UTF8_BYTE_CLASSES = make_utf8_byte_classes();
 
-  UTF8Block& operator=(UTF8Block&& other) {
-    *this = other; // non move
-    return *this;
-  }
+using UTF8TransitionTable = std::array<std::array<UTF8State, (size_t)UTF8ByteClass::COUNT>, (size_t)UTF8State::COUNT>;
 
-  UTF8Block& operator=(const UTF8Block& other) {
-    // last null char doesn't need to be copied around. constant for all instances
-    for (size_t i = 0; i < MAX_BYTES_PER_CHARACTER; ++i) {
-      data[i] = other.data[i];
+constexpr UTF8TransitionTable make_utf8_transitions() {
+  UTF8TransitionTable ret{};
+  using S = UTF8State;
+  using C = UTF8ByteClass;
+  for (auto& row : ret) {
+    for (auto& next : row) {
+      next = S::REJECT;
     }
-    return *this;
   }
 
-  bool operator==(const UTF8Block& other) const {
-    for (size_t i = 0; i < MAX_BYTES_PER_CHARACTER; ++i) {
-      if (data[i] != other.data[i]) {
-        return false;
-      }
-    }
-    return true;
-  };
-
-  // returns empty if not valid UTF-8
-  std::optional<wchar_t> to_wc() const {
-    // this is only needed because TTF_GlyphIsProvided32 doesn't have
-    // a UTF-8 version. but also the validity check is nice
-    wchar_t ret;
-    std::mbstate_t ctx = mbstate_t();
-    size_t result = mbrtowc(&ret, this->data, MAX_BYTES_PER_CHARACTER, &ctx);
-    assert(result != (size_t)-2 && result != (size_t)0);
-    if (result == (size_t)-1) {
-      return {};
-    }
-    return ret;
+  ret[(size_t)S::ACCEPT][(size_t)C::ASCII] = S::ACCEPT;
+  ret[(size_t)S::ACCEPT][(size_t)C::LEAD2] = S::NEED1;
+  ret[(size_t)S::ACCEPT][(size_t)C::E0] = S::AFTER_E0;
+  ret[(size_t)S::ACCEPT][(size_t)C::LEAD3] = S::NEED2;
+  ret[(size_t)S::ACCEPT][(size_t)C::ED] = S::AFTER_ED;
+  ret[(size_t)S::ACCEPT][(size_t)C::F0] = S::AFTER_F0;
+  ret[(size_t)S::ACCEPT][(size_t)C::LEAD4] = S::NEED3;
+  ret[(size_t)S::ACCEPT][(size_t)C::F4] = S::AFTER_F4;
+
+  for (C cont : {C::CONTINUATION_80, C::CONTINUATION_90, C::CONTINUATION_A0}) {
+    ret[(size_t)S::NEED1][(size_t)cont] = S::ACCEPT;
+    ret[(size_t)S::NEED2][(size_t)cont] = S::NEED1;
+    ret[(size_t)S::NEED3][(size_t)cont] = S::NEED2;
   }
+  ret[(size_t)S::AFTER_E0][(size_t)C::CONTINUATION_A0] = S::NEED1;
+  ret[(size_t)S::AFTER_ED][(size_t)C::CONTINUATION_80] = S::NEED1;
+  ret[(size_t)S::AFTER_ED][(size_t)C::CONTINUATION_90] = S::NEED1;
+  ret[(size_t)S::AFTER_F0][(size_t)C::CONTINUATION_90] = S::NEED2;
+  ret[(size_t)S::AFTER_F0][(size_t)C::CONTINUATION_A0] = S::NEED2;
+  ret[(size_t)S::AFTER_F4][(size_t)C::CONTINUATION_80] = S::NEED2;
+  return ret;
+}
+
+static constexpr UTF8TransitionTable UTF8_TRANSITIONS = make_utf8_transitions();
+
+// a single unicode character, or a control character (e.g. '\n').
+// always a valid code point; invalid utf8 becomes REPLACEMENT_CHARACTER
+struct CodePointBlock {
+  char32_t code_point;
 };
 
-namespace std {
-template <>
-struct hash<UTF8Block> {
-  size_t operator()(const UTF8Block& ch) const {
-    auto view = std::string_view(ch.data, MAX_BYTES_PER_CHARACTER);
-    return std::hash<std::string_view>{}(view);
-  }
+// a run of printable ascii, one cell per byte. this isn't part of Block; it's only
+// given to the sink of BlockStream::consume. data points into the buffer that was
+// passed to consume, so it's only valid for the duration of the sink call
+struct ASCIIRun {
+  const char* data;
+  size_t length;
 };
-} // namespace std
 
 struct ANSICursorUp {
   uint16_t n;
@@ -201,10 +283,20 @@ struct ANSIGraphicsBackground {
   Color c;
 };
 
+// CSI ? mode h (set) and CSI ? mode l (reset). e.g. 2026 is synchronized output
+struct ANSIPrivateMode {
+  uint16_t mode;
+  bool set;
+};
+
+// CSI ? mode $ p. the reply says whether the mode is recognized, and if it's set
+struct ANSIPrivateModeRequest {
+  uint16_t mode;
+};
+
 // a Block is an indivisible unit to be used in the display. it can be either
-// UTF-8 (possible invalid, validity is checked before displaying), or some ansi
-// escape sequence which applies various functionality
-using Block = std::variant<UTF8Block,                    //
+// a decoded character, or some ansi escape sequence which applies various functionality
+using Block = std::variant<CodePointBlock,               //
                            ANSICursorUp,                 //
                            ANSICursorDown,               //
                            ANSICursorForward,            //
@@ -224,276 +316,348 @@ using Block = std::variant<UTF8Block,                    //
                            ANSIGraphicsItalic,           //
                            ANSIGraphicsUnderline,        //
                            ANSIGraphicsForeground,       //
-                           ANSIGraphicsBackground>;
+                           ANSIGraphicsBackground,       //
+                           ANSIPrivateMode,              //
+                           ANSIPrivateModeRequest>;
 
-// consumes input over many calls, produces Blocks from the stream
+// consumes input over many calls, produces Blocks from the stream.
+// a sequence can be split at any byte across calls; the parser resumes where it left off
 class BlockStream {
   // this section of members is used when producing an ANSI escape block
-  enum ANSIParseState {
-    RESTORE,
-    HANDLE_PRIOR_INCOMPLETE_MULTIBYTE,
-    BLOCK_START,
-    ANSI_BLOCK,
-    CSI_RECEIVED,
-  } ansi_parse_state = RESTORE;
+  VTState state = VTState::GROUND;
 
   static constexpr size_t MAX_ARGS = 64; // https://vt100.net/emu/dec_ansi_parser after n (16 in the citation), args are ignored
-  size_t ansi_index;                     // index with args. fixed length vector
-  uint16_t ansi_args[MAX_ARGS];
+  size_t param_count = 0;                // number of params received. 0 if none
+  uint16_t params[MAX_ARGS];
 
-  // this section of members is used when producing a UTF8Block block
-  char incomplete[MAX_BYTES_PER_CHARACTER]; // incomplete multibyte
-  unsigned char bytes_to_complete = 0;      // number of bytes needed to complete it
-  unsigned char offset = 0;                 // next available index in incomplete
+  static constexpr size_t MAX_INTERMEDIATES = 2; // after this the sequence is ignored
+  size_t intermediate_count = 0;                 // > MAX_INTERMEDIATES on overflow
+  char intermediates[MAX_INTERMEDIATES];         // intermediate bytes and private marker (e.g. '?')
 
-  // this section of fields is used for ansi blocks
+  // this section of members is used when decoding utf8. a multibyte can be split across calls
+  UTF8State utf8_state = UTF8State::ACCEPT;
+  char32_t code_point = 0; // partially decoded code point
 
   BlockStream(const BlockStream&) = delete;
   BlockStream& operator=(const BlockStream&) = delete;
   BlockStream(BlockStream&&) = delete;
   BlockStream& operator=(BlockStream&&) = delete;
 
- public:
-  BlockStream() {}
-
-  std::vector<Block> consume(const char* data, size_t length) {
-    std::vector<Block> ret;
-
-    SM_ENTER_STATE(ansi_parse, RESTORE); // RESTORE is the start state
-
-    // re-enter the previous state of the machine from the last call.
-    // default next state is HANDLE_PRIOR_INCOMPLETE_MULTIBYTE
-    SM_DEFINE_STATE_BEGIN(ansi_parse, RESTORE);
-    ansi_parse_state = RESTORE;
-    switch (ansi_parse_state) {
-      default:
-        SM_ENTER_STATE(ansi_parse, HANDLE_PRIOR_INCOMPLETE_MULTIBYTE);
-        break;
-      case BLOCK_START:
-        SM_ENTER_STATE(ansi_parse, BLOCK_START);
-        break;
-      case ANSI_BLOCK:
-        SM_ENTER_STATE(ansi_parse, ANSI_BLOCK);
-        break;
-      case CSI_RECEIVED:
-        SM_ENTER_STATE(ansi_parse, CSI_RECEIVED);
+  // decodes utf8 starting at data, until an ascii byte or the end of the data.
+  // returns the position after the last byte consumed. each ill-formed subsequence
+  // (the longest prefix of a sequence that could have been valid, or a lone
+  // invalid byte) becomes a single REPLACEMENT_CHARACTER
+  template <typename Sink>
+  const char* decode_utf8(const char* data, const char* end, Sink& sink) {
+    while (data != end) {
+      unsigned char c = *data;
+      if (c < 0x80) {
+        if (utf8_state != UTF8State::ACCEPT) {
+          sink(CodePointBlock{REPLACEMENT_CHARACTER}); // interrupted multibyte
+          utf8_state = UTF8State::ACCEPT;
+        }
         break;
-    }
-    SM_END_STATE();
-
-    // check if there is a incomplete UTF-8 multibyte left over from the previous call.
-    // if there is, then bytes go to that first. if not, then move on to BLOCK_START
-    SM_DEFINE_STATE_BEGIN(ansi_parse, HANDLE_PRIOR_INCOMPLETE_MULTIBYTE);
-    ansi_parse_state = HANDLE_PRIOR_INCOMPLETE_MULTIBYTE;
-    if (bytes_to_complete != 0) { // handle the incomplete multibyte from previous call
-      if (bytes_to_complete <= length) {
-        // there is enough bytes to complete the incomplete multibyte
-        size_t num_to_take = bytes_to_complete;
-        memcpy(incomplete + offset, data, num_to_take);
-        UTF8Block blk;
-        memcpy(blk.data, incomplete, MAX_BYTES_PER_CHARACTER);
-        ret.push_back(blk);
-        offset = 0;
-        bytes_to_complete = 0;
-        data += num_to_take;
-        length -= num_to_take;
-      } else {
-        // there is not enough bytes to complete the so far incomplete multibyte
-        size_t num_to_take = length;
-        memcpy(incomplete + offset, data, num_to_take);
-        offset += num_to_take;
-        bytes_to_complete -= num_to_take;
-        return ret; // ret is empty
       }
-    }
-    SM_ENTER_STATE(ansi_parse, BLOCK_START);
-    SM_END_STATE();
-
-    // BLOCK_START checks if there is an escape character,
-    // and goes to ANSI_START if so, or if not it handles a UTF8 block
-    SM_DEFINE_STATE_BEGIN(ansi_parse, BLOCK_START);
-    ansi_parse_state = BLOCK_START;
-    if (length == 0) {
-      if (ret.size())
-      return ret;
-    }
 
-    if (*data != '\e') {
-      int bytes_needed = UTF8Block::u8_length(*data);
-      if (bytes_needed == -1) {
-        ret.push_back(UTF8Block::stray_continuation());
-        // progress by a single byte on error length block
+      UTF8State next = UTF8_TRANSITIONS[(size_t)utf8_state][(size_t)UTF8_BYTE_CLASSES[c]];
+      if (next == UTF8State::REJECT) {
+        sink(CodePointBlock{REPLACEMENT_CHARACTER});
+        if (utf8_state != UTF8State::ACCEPT) {
+          // the sequence so far is dropped. this byte might start a new one, so retry it
+          utf8_state = UTF8State::ACCEPT;
+          continue;
+        }
         data += 1;
-        length -= 1;
-        SM_ENTER_STATE(ansi_parse, BLOCK_START);
+        continue;
       }
 
-      if (bytes_needed <= length) {
-        // there is enough to complete the current character
-        UTF8Block ch;
-        memcpy(ch.data, data, bytes_needed);
-        ret.push_back(ch);
-        data += bytes_needed;
-        length -= bytes_needed;
-        SM_ENTER_STATE(ansi_parse, BLOCK_START);
+      if (utf8_state == UTF8State::ACCEPT) {
+        // lead byte. keep the bits that aren't part of the length prefix
+        code_point = c & (c >= 0xF0 ? 0b00000111 : c >= 0xE0 ? 0b00001111 : 0b00011111);
       } else {
-        // not enough. place it into incomplete
-        for (size_t i = 0; i < length; ++i) {
-          this->incomplete[offset++] = data[i];
-        }
-        bytes_to_complete = bytes_needed - length;
-        offset += length;
-        return ret;
+        code_point = (code_point << 6) | (c & 0b00111111);
       }
-    } else {
-      data += 1; // '\e' consumed.
-      length -= 1;
-      SM_ENTER_STATE(ansi_parse, ANSI_BLOCK);
-    }
-    SM_END_STATE();
+      utf8_state = next;
+      data += 1;
 
-    SM_DEFINE_STATE_BEGIN(ansi_parse, ANSI_BLOCK);
-    ansi_parse_state = ANSI_BLOCK;
-    if (length == 0) {
-      return ret;
-    }
-    bool success = *data == '[';
-    data += 1;
-    length -= 1;
-    if (!success) {
-      // consumes the \e and one following
-      SM_ENTER_STATE(ansi_parse, BLOCK_START);
+      if (utf8_state == UTF8State::ACCEPT) {
+        sink(CodePointBlock{code_point});
+      }
     }
-    ansi_index = 0;
+    return data;
+  }
+
+  void clear() {
+    param_count = 0;
     // some commands use 0s as default args.
     // only clear first and second. if a function name (letter) is received right away, then that's all it will use
-    ansi_args[0] = 0;
-    ansi_args[1] = 0;
-    SM_ENTER_STATE(ansi_parse, CSI_RECEIVED);
-    SM_END_STATE();
-
-    SM_DEFINE_STATE_BEGIN(ansi_parse, CSI_RECEIVED);
-    ansi_parse_state = CSI_RECEIVED;
-    if (length == 0) {
-      return ret;
+    params[0] = 0;
+    params[1] = 0;
+    intermediate_count = 0;
+  }
+
+  void param(unsigned char c) {
+    if (param_count == 0) {
+      // the first param is created by either a digit or a separator
+      param_count = 1;
+      params[0] = 0;
     }
 
-    char ch = *data;
-    data += 1;
-    length -= 1;
+    if (param_count > MAX_ARGS) {
+      return; // ignore if max args exceeded
+    }
 
-    if (ch == 'h') {
-      ch = '1';
+    if (c == ';') {
+      // argument separator
+      param_count += 1;
+      if (param_count <= MAX_ARGS) {
+        params[param_count - 1] = 0;
+      }
+    } else {
+      uint16_t& p = params[param_count - 1];
+      unsigned int value = p * 10u + (c - '0');
+      p = value > UINT16_MAX ? UINT16_MAX : value;
     }
+  }
 
-    if ((ch >= '0' && ch <= '9') || ch == ';') {
-      if (ansi_index < MAX_ARGS) { // ignore if max args exceeded
-        // ansi argument related
-        if (ch == ';') {
-          // argument separator
-          ansi_index += 1;
-          ansi_args[ansi_index] = 0;
-        } else {
-          ansi_args[ansi_index] *= 10;
-          ansi_args[ansi_index] += ch - '0';
+  template <typename Sink>
+  void esc_dispatch(unsigned char c, Sink& sink) {
+    if (intermediate_count != 0) {
+      return; // designate character set etc. not implemented
+    }
+
+    if (c == '7') {
+      sink(ANSISaveCursor());
+    } else if (c == '8') {
+      sink(ANSILoadCursor());
+    }
+  }
+
+  // CSI ? ...
+  template <typename Sink>
+  void private_dispatch(unsigned char ch, Sink& sink) {
+    if (intermediate_count == 1 && (ch == 'h' || ch == 'l')) {
+      // any number of modes can be set or reset at once
+      for (size_t i = 0; i < param_count; ++i) {
+        if (params[i] != 0) {
+          sink(ANSIPrivateMode{params[i], ch == 'h'});
         }
       }
-      SM_ENTER_STATE(ansi_parse, CSI_RECEIVED);
-    } else if (ch == '\e') {
-      SM_ENTER_STATE(ansi_parse, ANSI_BLOCK);
-    } else if (ch == 'm') {
+    } else if (intermediate_count == 2 && intermediates[1] == '$' && ch == 'p') {
+      if (param_count != 0) {
+        sink(ANSIPrivateModeRequest{params[0]});
+      }
+    }
+  }
+
+  template <typename Sink>
+  void csi_dispatch(unsigned char ch, Sink& sink) {
+    if (param_count > MAX_ARGS) {
+      param_count = MAX_ARGS;
+    }
+
+    if (intermediate_count != 0) {
+      if (intermediate_count <= MAX_INTERMEDIATES && intermediates[0] == '?') {
+        private_dispatch(ch, sink);
+      }
+      return; // other sequences with intermediates are not implemented
+    }
+
+    if (ch == 'm') {
       // select graphics rendition
-      if (ansi_index < MAX_ARGS) {
-        ++ansi_index;
+      if (param_count == 0) {
+        param_count = 1; // ESC[m is the same as ESC[0m. params[0] is cleared on entry
       }
-      for (size_t i = 0; i < ansi_index; ++i) {
-        if (ansi_args[i] == 0) {
-          ret.push_back(ANSIGraphicsReset());
-        } else if (ansi_args[i] == 1) {
-          ret.push_back(ANSIGraphicsBold());
-        } else if (ansi_args[i] == 3) {
-          ret.push_back(ANSIGraphicsItalic());
-        } else if (ansi_args[i] >= 30 && ansi_args[i] <= 37) {
-          ret.push_back(ANSIGraphicsForeground{Color::from8(ansi_args[i] - 30)});
-        } else if (ansi_args[i] >= 40 && ansi_args[i] <= 47) {
-          ret.push_back(ANSIGraphicsBackground{Color::from8(ansi_args[i] - 40)});
-        } else if (ansi_args[i] == 38) {
-          if (i + 1 < ansi_index) {
+      for (size_t i = 0; i < param_count; ++i) {
+        if (params[i] == 0) {
+          sink(ANSIGraphicsReset());
+        } else if (params[i] == 1) {
+          sink(ANSIGraphicsBold());
+        } else if (params[i] == 3) {
+          sink(ANSIGraphicsItalic());
+        } else if (params[i] >= 30 && params[i] <= 37) {
+          sink(ANSIGraphicsForeground{Color::from8(params[i] - 30)});
+        } else if (params[i] >= 40 && params[i] <= 47) {
+          sink(ANSIGraphicsBackground{Color::from8(params[i] - 40)});
+        } else if (params[i] == 38) {
+          if (i + 1 < param_count) {
             // next index is valid (check for 2 or 5)
-            if (ansi_args[i + 1] == 5) {
+            if (params[i + 1] == 5) {
               // foreground via 256 palette
-              if (i + 2 < ansi_index) {
+              if (i + 2 < param_count) {
                 // next next index is valid
-                ret.push_back(ANSIGraphicsForeground{Color::from256(ansi_args[i + 2])});
+                sink(ANSIGraphicsForeground{Color::from256(params[i + 2])});
               }
-            } else if (ansi_args[i + 1] == 2) {
+            } else if (params[i + 1] == 2) {
               // foreground via rgb
-              if (i + 4 < ansi_index) { // next, next 3 indices are valid
-                ret.push_back(ANSIGraphicsForeground{Color{//
-                                                           (unsigned char)ansi_args[i + 2], (unsigned char)ansi_args[i + 3], (unsigned char)ansi_args[i + 4]}});
+              if (i + 4 < param_count) { // next, next 3 indices are valid
+                sink(ANSIGraphicsForeground{Color{//
+                                                           (unsigned char)params[i + 2], (unsigned char)params[i + 3], (unsigned char)params[i + 4]}});
               }
             }
           }
           break;
-        } else if (ansi_args[i] == 48) {
+        } else if (params[i] == 48) {
           // copy paste of above but background instead of foreground
-          if (i + 1 < ansi_index) {
+          if (i + 1 < param_count) {
             // next index is valid (check for 2 or 5)
-            if (ansi_args[i + 1] == 5) {
+            if (params[i + 1] == 5) {
               // background via 256 palette
-              if (i + 2 < ansi_index) {
+              if (i + 2 < param_count) {
                 // next next index is valid
-                ret.push_back(ANSIGraphicsBackground{Color::from256(ansi_args[i + 2])});
+                sink(ANSIGraphicsBackground{Color::from256(params[i + 2])});
               }
-            } else if (ansi_args[i + 1] == 2) {
+            } else if (params[i + 1] == 2) {
               // background via rgb
-              if (i + 4 < ansi_index) {                    // next, next 3 indices are valid
-                ret.push_back(ANSIGraphicsBackground{Color{//
-                                                           (unsigned char)ansi_args[i + 2], (unsigned char)ansi_args[i + 3], (unsigned char)ansi_args[i + 4]}});
+              if (i + 4 < param_count) {                    // next, next 3 indices are valid
+                sink(ANSIGraphicsBackground{Color{//
+                                                           (unsigned char)params[i + 2], (unsigned char)params[i + 3], (unsigned char)params[i + 4]}});
               }
             }
           }
           break;
-        } else if (ansi_args[i] >= 90 && ansi_args[i] <= 97) {
-          ret.push_back(ANSIGraphicsForeground{Color::from8bright(ansi_args[i] - 90)});
-        } else if (ansi_args[i] >= 100 && ansi_args[i] <= 107) {
-          ret.push_back(ANSIGraphicsBackground{Color::from8bright(ansi_args[i] - 100)});
+        } else if (params[i] >= 90 && params[i] <= 97) {
+          sink(ANSIGraphicsForeground{Color::from8bright(params[i] - 90)});
+        } else if (params[i] >= 100 && params[i] <= 107) {
+          sink(ANSIGraphicsBackground{Color::from8bright(params[i] - 100)});
         } else {
           break;
         }
       }
     } else {
       if (ch == 'A') {
-        ret.push_back(ANSICursorUp{ansi_args[0]});
+        sink(ANSICursorUp{params[0]});
       } else if (ch == 'B') {
-        ret.push_back(ANSICursorDown{ansi_args[0]});
+        sink(ANSICursorDown{params[0]});
       } else if (ch == 'C') {
-        ret.push_back(ANSICursorForward{ansi_args[0]});
+        sink(ANSICursorForward{params[0]});
       } else if (ch == 'D') {
-        ret.push_back(ANSICursorBack{ansi_args[0]});
+        sink(ANSICursorBack{params[0]});
       } else if (ch == 'E') {
-        ret.push_back(ANSICursorNextLine{ansi_args[0]});
+        sink(ANSICursorNextLine{params[0]});
       } else if (ch == 'F') {
-        ret.push_back(ANSICursorPreviousLine{ansi_args[0]});
-      } else if (ch == 'G' || ch == 'f') {
-        ret.push_back(ANSICursorHorizontalAbsolute{ansi_args[0]});
-      } else if (ch == 'H') {
-        ret.push_back(ANSICursorPosition{ansi_args[0], ansi_args[1]});
+        sink(ANSICursorPreviousLine{params[0]});
+      } else if (ch == 'G') {
+        sink(ANSICursorHorizontalAbsolute{params[0]});
+      } else if (ch == 'H' || ch == 'f') {
+        sink(ANSICursorPosition{params[0], params[1]});
       } else if (ch == 'J') {
-        ret.push_back(ANSIEraseDisplay{(unsigned char)ansi_args[0]});
+        sink(ANSIEraseDisplay{(unsigned char)params[0]});
       } else if (ch == 'K') {
-        ret.push_back(ANSIEraseLine{(unsigned char)ansi_args[0]});
+        sink(ANSIEraseLine{(unsigned char)params[0]});
       } else if (ch == 'S') {
-        ret.push_back(ANSIScrollUp{ansi_args[0]});
+        sink(ANSIScrollUp{params[0]});
       } else if (ch == 'T') {
-        ret.push_back(ANSIScrollDown{ansi_args[0]});
+        sink(ANSIScrollDown{params[0]});
       } else if (ch == 's') {
-        ret.push_back(ANSISaveCursor());
+        sink(ANSISaveCursor());
       } else if (ch == 'u') {
-        ret.push_back(ANSILoadCursor());
+        sink(ANSILoadCursor());
+      }
+    }
+  }
+
+ public:
+  BlockStream() {}
+
+  // parses the data, passing each produced block to the sink as it's completed.
+  // the sink is called with the concrete block type (e.g. sink(CodePointBlock) or
+  // sink(ANSICursorDown)), so it can be a generic lambda. nothing is allocated.
+  // printable ascii is given as ASCIIRun rather than one CodePointBlock per character
+  template <typename Sink>
+  void consume(const char* data, size_t length, Sink&& sink) {
+    const char* end = data + length;
+    while (data != end) {
+      if (state == VTState::GROUND && utf8_state == UTF8State::ACCEPT) {
+        // fast path. most of what the shell sends is printable ascii, so hand it over as a single run
+        size_t run_length = printable_ascii_length(data, end - data);
+        if (run_length != 0) {
+          sink(ASCIIRun{data, run_length});
+          data += run_length;
+          if (data == end) {
+            break;
+          }
+        }
+      }
+
+      unsigned char c = *data++;
+      unsigned char transition = VT_TRANSITIONS[(size_t)state][(size_t)VT_BYTE_CLASSES[c]];
+      VTAction action = vt_transition_action(transition);
+      state = vt_transition_state(transition);
+
+      if (utf8_state != UTF8State::ACCEPT && (action != VTAction::PRINT || c < 0x80)) {
+        // a multibyte was interrupted (by a control, escape, or ascii)
+        sink(CodePointBlock{REPLACEMENT_CHARACTER});
+        utf8_state = UTF8State::ACCEPT;
+      }
+
+      switch (action) {
+        case VTAction::NONE:
+          break;
+        case VTAction::PRINT:
+          if (c < 0x80) {
+            sink(CodePointBlock{c});
+          } else {
+            // decode as much as possible in one go, rather than going through the table per byte
+            data = decode_utf8(data - 1, end, sink);
+          }
+          break;
+        case VTAction::EXECUTE:
+          // control characters are given as is
+          sink(CodePointBlock{c});
+          break;
+        case VTAction::CLEAR:
+          clear();
+          break;
+        case VTAction::COLLECT:
+          if (intermediate_count < MAX_INTERMEDIATES) {
+            intermediates[intermediate_count] = c;
+          }
+          if (intermediate_count <= MAX_INTERMEDIATES) {
+            ++intermediate_count;
+          }
+          break;
+        case VTAction::PARAM:
+          param(c);
+          break;
+        case VTAction::ESC_DISPATCH:
+          esc_dispatch(c, sink);
+          break;
+        case VTAction::CSI_DISPATCH:
+          csi_dispatch(c, sink);
+          break;
+        case VTAction::HOOK:
+        case VTAction::PUT:
+        case VTAction::OSC_START:
+        case VTAction::OSC_PUT:
+          // device control strings and operating system commands (window title etc.)
+          // are consumed but not implemented
+          break;
+        case VTAction::UNHOOK:
+        case VTAction::OSC_END:
+          // these are also the transitions into ESCAPE from a string, so they clear like entering ESCAPE does
+          clear();
+          break;
+        case VTAction::COUNT:
+          assert(false && "not an action");
+          break;
       }
     }
-    SM_ENTER_STATE(ansi_parse, BLOCK_START);
-    SM_END_STATE();
+  }
+
+  // same as above, but collects the blocks into a container
+  std::vector<Block> consume(const char* data, size_t length) {
+    std::vector<Block> ret;
+    consume(data, length, [&](const auto& blk) {
+      if constexpr (std::is_same_v<std::decay_t<decltype(blk)>, ASCIIRun>) {
+        // the run points into data. copy it out as individual characters
+        for (size_t i = 0; i < blk.length; ++i) {
+          ret.push_back(CodePointBlock{(unsigned char)blk.data[i]});
+        }
+      } else {
+        ret.push_back(blk);
+      }
+    });
+    return ret;
   }
 };
@@ -0,0 +1,121 @@
+// make test. no dependencies on sdl, so it runs anywhere
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+
+#include "glyph_cache_utils.hpp"
+#include "screen_utils.hpp"
+#include "scrollback_utils.hpp"
+
+static auto ignore_scroll_off = [](const Cell*, unsigned int, bool) {};
+
+static Cell cell(char32_t code_point) { return Cell{code_point, 0, AttributeTable::DEFAULT_ID}; }
+
+// ================ screen
+
+void test_put_wraps_after_last_column() {
+  Screen screen(4, 3);
+  for (char c : {'a', 'b', 'c', 'd'}) {
+    screen.put(cell(c), Cell::blank(), ignore_scroll_off);
+  }
+  // the last column was written. the cursor stays on it until the next character
+  assert(screen.cursor.row == 0 && screen.cursor.col == 3 && screen.cursor.pending_wrap);
+  screen.put(cell('e'), Cell::blank(), ignore_scroll_off);
+  assert(screen.cursor.row == 1 && screen.cursor.col == 1 && !screen.cursor.pending_wrap);
+  assert(screen.row(1)[0].code_point == 'e');
+  assert(screen.row_wraps(0));
+}
+
+void test_put_ascii_wraps_after_last_column() {
+  Screen screen(4, 3);
+  size_t n = screen.put_ascii("abcdef", 6, 0, AttributeTable::DEFAULT_ID, Cell::blank(), ignore_scroll_off);
+  assert(n == 4);
+  assert(screen.cursor.row == 0 && screen.cursor.col == 3 && screen.cursor.pending_wrap);
+  n = screen.put_ascii("ef", 2, 0, AttributeTable::DEFAULT_ID, Cell::blank(), ignore_scroll_off);
+  assert(n == 2);
+  assert(screen.cursor.row == 1 && screen.cursor.col == 2);
+  assert(screen.row(1)[0].code_point == 'e' && screen.row(1)[1].code_point == 'f');
+  assert(screen.row_wraps(0));
+}
+
+void test_tab_after_last_column_stays_on_row() {
+  // like xterm, the tab cancels the pending wrap. the next character overwrites the last column
+  Screen screen(4, 3);
+  screen.put_ascii("abcd", 4, 0, AttributeTable::DEFAULT_ID, Cell::blank(), ignore_scroll_off);
+  assert(screen.cursor.pending_wrap);
+  screen.tab();
+  assert(screen.cursor.row == 0 && screen.cursor.col == 3 && !screen.cursor.pending_wrap);
+  screen.put(cell('x'), Cell::blank(), ignore_scroll_off);
+  assert(screen.cursor.row == 0 && screen.row(0)[3].code_point == 'x');
+  assert(!screen.row_wraps(0));
+}
+
+// ================ scrollback
+
+void test_spill_file_is_bounded_by_line_limit() {
+  // the memory limit is low, so nearly everything is spilled. the line limit then drops the
+  // oldest spilled chunks, and the file's storage must stay about the same from then on
+  Scrollback scrollback({3000, 50000, 300, true}, 80);
+  Cell row[80];
+  uint32_t seed = 1;
+  size_t usage_after_warmup = 0;
+  for (size_t i = 0; i < 400000; ++i) {
+    for (Cell& c : row) {
+      seed = seed * 1103515245 + 12345;
+      c = Cell{(char32_t)('!' + (seed >> 16) % 90), 0, AttributeTable::DEFAULT_ID};
+    }
+    scrollback.push_row(row, 80, false);
+    assert(scrollback.end_line() - scrollback.begin_line() <= 3000 + Scrollback::LINES_PER_CHUNK);
+    if (i == 50000) {
+      usage_after_warmup = scrollback.spill_file_usage();
+      assert(usage_after_warmup != 0);
+    }
+  }
+  size_t usage = scrollback.spill_file_usage();
+  assert(usage <= usage_after_warmup * 2);
+}
+
+// ================ glyph cache
+
+void test_glyph_cache_rejects_oversized_glyphs() {
+  char dir[] = "/tmp/glyph-cache-test-XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string font_path = std::string(dir) + "/font.ttf";
+  FILE* font = fopen(font_path.c_str(), "w");
+  fputs("font", font);
+  fclose(font);
+  std::optional<GlyphCache::Key> key = GlyphCache::key_for(font_path.c_str(), 32);
+  assert(key);
+  std::string path = GlyphCache::path_for(dir, *key);
+
+  std::vector<uint32_t> pixels(3 * 4, 0xFFFFFFFF);
+  assert(GlyphCache::save(path, *key, {GlyphCache::Entry{'a', 3, 4, 0}}, pixels));
+  {
+    std::optional<GlyphCache> cache = GlyphCache::open(path, *key, 16);
+    assert(cache && cache->size() == 1 && (*cache)[0].width == 3 && cache->pixels((*cache)[0])[11] == 0xFFFFFFFF);
+  }
+
+  // too large for the atlas. the file is deleted rather than failing every start
+  pixels.assign(20 * 4, 0);
+  assert(GlyphCache::save(path, *key, {GlyphCache::Entry{'a', 20, 4, 0}}, pixels));
+  assert(!GlyphCache::open(path, *key, 16));
+  assert(access(path.c_str(), F_OK) == -1);
+
+  // empty glyphs are corrupt too
+  assert(GlyphCache::save(path, *key, {GlyphCache::Entry{'a', 0, 4, 0}}, {}));
+  assert(!GlyphCache::open(path, *key, 16));
+  assert(access(path.c_str(), F_OK) == -1);
+
+  unlink(font_path.c_str());
+  rmdir(dir);
+}
+
+int main() {
+  test_put_wraps_after_last_column();
+  test_put_ascii_wraps_after_last_column();
+  test_tab_after_last_column_stays_on_row();
+  test_spill_file_is_bounded_by_line_limit();
+  test_glyph_cache_rejects_oversized_glyphs();
+  puts("all tests passed");
+  return 0;
+}